@@ -1,10 +1,84 @@
 #include "fat32.h"
 #include "sdcard.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 uint8_t fat32_sectors_per_cluster = 0;
 uint32_t fat32_root_cluster = 2;
 uint32_t fat32_fat_start = 0;
 uint32_t fat32_data_start = 0;
+uint32_t fat32_cluster_count = 0;
+uint32_t fat32_free_hint = 3;
+uint32_t fat32_au_clusters = 0;
+uint32_t fat32_free_count = FSINFO_UNKNOWN;
+
+static uint32_t _au_first = 2;    /* First cluster of the first whole AU. */
+static uint32_t _au_next = 2;     /* Where the search for an empty AU resumes. */
+static uint32_t _au_fill = 2;     /* Next cluster of the AU being filled. */
+
+#ifdef FAT32_DISCARD
+static uint32_t _discard_first[FAT32_DISCARD];
+static uint32_t _discard_count[FAT32_DISCARD];
+static uint8_t _discard_runs = 0;  /* Freed cluster runs not erased yet. */
+static bool _discard_defer = false;
+#endif
+
+static uint32_t _fsinfo_sector = 0;         /* 0 if the volume has none. */
+static uint32_t _fsinfo_free = FSINFO_UNKNOWN; /* Free count on the card. */
+static uint32_t _scan_pos = 2;    /* Next cluster fat32_scan_free() looks at. */
+static uint32_t _scan_free = 0;   /* Free clusters below _scan_pos. */
+
+static uint32_t _defrag_dir = 0;  /* Directory cluster of the next entry,
+                                   * 0 at the start of a pass. */
+static uint16_t _defrag_index;    /* Entry within that cluster. */
+static bool _defrag_moved = false; /* The current pass changed something. */
+static uint32_t _defrag_cand = 0; /* First cluster of the file looked at. */
+static uint32_t _defrag_check;    /* Next cluster of it to check, */
+static uint32_t _defrag_check_left; /* clusters left, 0 once fragmented. */
+static uint32_t _defrag_scan;     /* Next FAT entry the run search reads. */
+static uint32_t _defrag_run_first; /* Free run found so far. */
+static uint32_t _defrag_run;
+static uint32_t _defrag_from = 0; /* First cluster of the file in transit. */
+static uint32_t _defrag_to;       /* Where its contiguous copy goes. */
+static uint32_t _defrag_size;
+static uint32_t _defrag_entry_sector;
+static uint8_t _defrag_entry_offset;
+static uint32_t _defrag_done;     /* Sectors copied so far. */
+static uint32_t _defrag_src;      /* Source cluster behind the current run. */
+static uint32_t _defrag_src_sector;
+static uint32_t _defrag_src_left; /* Sectors left in the current run. */
+
+static uint32_t _dir_free_sector = 0; /* No slot in front of it is free. */
+static uint8_t _dir_free_offset;  /* Entry within that sector. */
+
+#ifdef FAT32_SNAPSHOT
+static bool _snapshot_live = false; /* The snapshot on the card is current. */
+static uint32_t _au_resume = 0;   /* AU size _au_next/_au_fill came with. */
+#endif
+
+#ifdef FAT32_OPEN_FILES
+/* What all handles fat32_open() gave out for the same file share. */
+typedef struct {
+    uint8_t users;          /* Handles pointing here, 0 if unused. */
+    bool exists;
+    char name[13];
+    Fat32EntryAttr attr;
+    uint32_t starting_cluster;
+    uint32_t file_size;
+    uint32_t entry_sector;
+    uint8_t entry_offset;
+    uint32_t cluster;       /* Last point of the chain any of them found. */
+    uint32_t cluster_pos;
+    uint32_t run;
+} Fat32Shared;
+
+static Fat32File _open_files[FAT32_OPEN_FILES];
+static Fat32Shared _shared[FAT32_OPEN_FILES];
+#endif
+
+#define FAT_SECTOR(C) (fat32_fat_start + (C) / (SD_SECTOR_SIZE / 4))
 
 static uint8_t _trim_space(char *str, uint8_t len) {
     while (str[--len] == ' ')
@@ -61,8 +135,36 @@ static bool _rev_copy_name(char *dest, const char *src) {
     return true;
 }
 
+/**
+ * @return true if @param name matches @param pattern, in which '*' stands
+ * for any number of characters and '?' for exactly one. */
+static bool _match_name(const char *pattern, const char *name) {
+    const char *star = NULL;
+    const char *retry = name;
+    while (*name) {
+        if (*pattern == '*') {
+            star = ++pattern;
+            retry = name;
+        } else if (*pattern == '?' || *pattern == *name) {
+            pattern++;
+            name++;
+        } else if (star) {
+            pattern = star;
+            name = ++retry;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '*')
+        pattern++;
+    return !*pattern;
+}
+
+static uint32_t _data_held = 0;   /* File data sector in sdcard_sector. */
 
 static bool _read_sector(uint32_t sector, uint8_t *data) {
+    if (data == sdcard_sector)
+        _data_held = 0;
     uint8_t tries = READ_SECTOR_TRIES;
     while(!sdcard_read_sector(sector, data))
         if (!tries--)
@@ -70,6 +172,168 @@ static bool _read_sector(uint32_t sector, uint8_t *data) {
     return true;
 }
 
+#ifdef FAT32_READ_AHEAD
+static uint8_t _ra_buf[FAT32_READ_AHEAD][SD_SECTOR_SIZE];
+static uint32_t _ra_sector[FAT32_READ_AHEAD];
+static uint8_t _ra_count = 0;     /* Buffers holding prefetched sectors. */
+static uint8_t _ra_seen = 0;      /* Of those, how many were read from. */
+static Fat32File *_ra_owner = NULL;
+
+static bool _read_sectors(uint32_t sector, uint8_t count, uint8_t *data) {
+    uint8_t tries = READ_SECTOR_TRIES;
+    while(!sdcard_read_sectors(sector, count, data))
+        if (!tries--)
+            return false;
+    return true;
+}
+#endif
+
+static void _write_sector(uint32_t sector, uint8_t *data) {
+    if (data == sdcard_sector || sector == _data_held)
+        _data_held = 0;
+#ifdef FAT32_READ_AHEAD
+    /* Keep prefetched copies coherent. */
+    for (uint8_t i = 0; i < _ra_count; ++i)
+        if (_ra_sector[i] == sector)
+            memcpy(_ra_buf[i], data, SD_SECTOR_SIZE);
+#endif
+    sdcard_write_sector(sector, data);
+}
+
+#ifdef FAT32_READ_AHEAD
+static void _write_sectors(uint32_t sector, uint8_t count, uint8_t *data) {
+    if (data == sdcard_sector || _data_held - sector < count)
+        _data_held = 0;
+    for (uint8_t i = 0; i < _ra_count; ++i)
+        if (_ra_sector[i] - sector < count)
+            memcpy(_ra_buf[i], data + (_ra_sector[i] - sector) * SD_SECTOR_SIZE,
+                   SD_SECTOR_SIZE);
+    sdcard_write_sectors(sector, count, data);
+}
+#endif
+
+#ifdef FAT32_TRACE
+static Fat32TraceRecord _trace_ring[FAT32_TRACE_SIZE];
+static uint16_t _trace_head = 0;
+static uint16_t _trace_len = 0;
+uint32_t fat32_trace_lost = 0;
+
+static void _trace(uint32_t sector, uint16_t tag) {
+    uint16_t i = (_trace_head + _trace_len) % FAT32_TRACE_SIZE;
+    if (_trace_len == FAT32_TRACE_SIZE) {
+        /* Full, drop the oldest record. */
+        _trace_head = (_trace_head + 1) % FAT32_TRACE_SIZE;
+        fat32_trace_lost++;
+    } else {
+        _trace_len++;
+    }
+    _trace_ring[i].sector = sector;
+    _trace_ring[i].time = SD_MICROS();
+    _trace_ring[i].tag = tag;
+}
+
+uint16_t fat32_trace_read(Fat32TraceRecord *out, uint16_t max) {
+    uint16_t n = 0;
+    while (n < max && _trace_len) {
+        out[n++] = _trace_ring[_trace_head];
+        _trace_head = (_trace_head + 1) % FAT32_TRACE_SIZE;
+        _trace_len--;
+    }
+    return n;
+}
+
+static bool _traced_read_sector(uint32_t sector, uint8_t *data,
+                                uint16_t tag) {
+    _trace(sector, tag);
+    return _read_sector(sector, data);
+}
+
+#ifdef FAT32_READ_AHEAD
+static bool _traced_read_sectors(uint32_t sector, uint8_t count, uint8_t *data,
+                                 uint16_t tag) {
+    for (uint8_t i = 0; i < count; ++i)
+        _trace(sector + i, tag);
+    return _read_sectors(sector, count, data);
+}
+#endif
+
+static void _traced_write_sector(uint32_t sector, uint8_t *data,
+                                 uint16_t tag) {
+    _trace(sector, tag | FAT32_TRACE_WRITE);
+    _write_sector(sector, data);
+}
+
+#ifdef FAT32_READ_AHEAD
+static void _traced_write_sectors(uint32_t sector, uint8_t count,
+                                  uint8_t *data, uint16_t tag) {
+    for (uint8_t i = 0; i < count; ++i)
+        _trace(sector + i, tag | FAT32_TRACE_WRITE);
+    _write_sectors(sector, count, data);
+}
+#endif
+
+/* From here on every request is recorded with the line it came from. */
+#define _read_sector(S, D) _traced_read_sector((S), (D), __LINE__)
+#define _write_sector(S, D) _traced_write_sector((S), (D), __LINE__)
+#define _read_sectors(S, N, D) _traced_read_sectors((S), (N), (D), __LINE__)
+#define _write_sectors(S, N, D) _traced_write_sectors((S), (N), (D), __LINE__)
+#endif
+
+#ifdef FAT32_SNAPSHOT
+static uint32_t _snapshot_sum(const Fat32Snapshot *snap) {
+    const uint8_t *p = (const uint8_t *) snap;
+    uint32_t sum = 0;
+    for (uint8_t i = 0; i < sizeof (*snap) - 4; ++i)
+        sum = (sum << 5 | sum >> 27) + p[i];
+    return sum;
+}
+
+/* Saves what mounting would have to find out again into @param info. */
+static void _snapshot_take(Fat32FsInfo *info) {
+    Fat32Snapshot *snap = &info->snapshot;
+    memset(snap, 0, sizeof (*snap));
+    snap->magic = FAT32_SNAPSHOT_MAGIC;
+    snap->generation = info->generation;
+    snap->free_count = info->free_count;
+    snap->next_free = info->next_free;
+    snap->scan_pos = _scan_pos;
+    snap->scan_free = _scan_free;
+    snap->dir_free_sector = _dir_free_sector;
+    snap->dir_free_offset = _dir_free_offset;
+    snap->au_clusters = fat32_au_clusters;
+    snap->au_next = _au_next;
+    snap->au_fill = _au_fill;
+    snap->checksum = _snapshot_sum(snap);
+}
+
+/**
+ * Takes the state saved in @param info back.
+ * @return false if there is none or the volume changed since, the
+ * generation moves on with every change after a snapshot and other
+ * systems leave FSInfo's free count or hint behind different. */
+static bool _snapshot_load(const Fat32FsInfo *info) {
+    const Fat32Snapshot *snap = &info->snapshot;
+    if (snap->magic != FAT32_SNAPSHOT_MAGIC
+        || snap->checksum != _snapshot_sum(snap)
+        || snap->generation != info->generation
+        || snap->free_count != info->free_count
+        || snap->next_free != info->next_free
+        || snap->free_count > fat32_cluster_count
+        || snap->scan_pos < 2 || snap->scan_pos > fat32_cluster_count + 2
+        || (snap->dir_free_sector
+            && snap->dir_free_sector < fat32_data_start))
+        return false;
+    _scan_pos = snap->scan_pos;
+    _scan_free = snap->scan_free;
+    _dir_free_sector = snap->dir_free_sector;
+    _dir_free_offset = snap->dir_free_offset;
+    _au_resume = snap->au_clusters;
+    _au_next = snap->au_next;
+    _au_fill = snap->au_fill;
+    return true;
+}
+#endif
+
 Fat32Error fat32_mount(void) {
     if (!sdcard_ready)
         return FAT32_NO_SDCARD;
@@ -107,6 +371,47 @@ Fat32Error fat32_mount(void) {
     fat32_data_start = fat32_fat_start +
         bsect->fat_size_sectors * bsect->number_of_fats;
     fat32_root_cluster = bsect->cluster_num_for_root;
+    uint16_t fsinfo = bsect->sector_fsinfo;
+    uint32_t total_sectors = bsect->total_sectors_u16
+        ? bsect->total_sectors_u16 : bsect->total_sectors_u32;
+    fat32_cluster_count = (total_sectors - (fat32_data_start - start_sector))
+        / fat32_sectors_per_cluster;
+    fat32_free_hint = fat32_root_cluster + 1;
+    fat32_au_clusters = 0;
+    _dir_free_sector = 0;
+    _defrag_dir = 0;
+    _defrag_cand = 0;
+#ifdef FAT32_SNAPSHOT
+    _snapshot_live = false;
+    _au_resume = 0;
+#endif
+#ifdef FAT32_DISCARD
+    _discard_runs = 0;
+#endif
+
+    /* Trust FSInfo as long as it looks sane, fat32_scan_free() checks. */
+    fat32_free_count = FSINFO_UNKNOWN;
+    _fsinfo_sector = 0;
+    _fsinfo_free = FSINFO_UNKNOWN;
+    _scan_pos = 2;
+    _scan_free = 0;
+    if (fsinfo && fsinfo != 0xffff
+        && _read_sector(start_sector + fsinfo, sdcard_sector)) {
+        Fat32FsInfo *info = (Fat32FsInfo *) sdcard_sector;
+        if (info->lead_signature == FSINFO_LEAD_SIGNATURE
+            && info->struct_signature == FSINFO_STRUCT_SIGNATURE
+            && info->trail_signature == FSINFO_TRAIL_SIGNATURE) {
+            _fsinfo_sector = start_sector + fsinfo;
+            if (info->free_count <= fat32_cluster_count)
+                fat32_free_count = _fsinfo_free = info->free_count;
+            if (info->next_free >= 2
+                && info->next_free < fat32_cluster_count + 2)
+                fat32_free_hint = info->next_free;
+#ifdef FAT32_SNAPSHOT
+            _snapshot_live = _snapshot_load(info);
+#endif
+        }
+    }
 
     return FAT32_OK;
 }
@@ -118,27 +423,717 @@ uint32_t fat32_get_next_cluster(uint32_t cluster) {
     cluster %= SD_SECTOR_SIZE / 4;
     uint32_t (*fat)[SD_SECTOR_SIZE / 4] = (uint32_t (*)[SD_SECTOR_SIZE / 4])
         sdcard_sector;
-    return (*fat)[cluster];
+    return (*fat)[cluster] & 0x0fffffff;
 }
 
-uint32_t fat32_claim_free_cluster(void) {
-    uint32_t sector = fat32_fat_start;
+/**
+ * @return the first of entries @param from to @param to (exclusive) of the
+ * FAT sector @param fat that is free, or used if @param free is false; to
+ * if there is none. */
+static uint16_t _fat_find(const uint32_t *fat, uint16_t from, uint16_t to,
+                          bool free) {
+    uint16_t i = from;
+#ifdef __SSE2__
+    /* Four entries per compare, the mask has a bit per free one. */
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= to; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (fat + i));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero)));
+        if (!free)
+            mask ^= 0xf;
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#else
+    /* Four entries per test, one branch skips a block with nothing. */
+    for (; i + 4 <= to; i += 4) {
+        if (free ? !(fat[i] && fat[i + 1] && fat[i + 2] && fat[i + 3])
+            : (fat[i] | fat[i + 1] | fat[i + 2] | fat[i + 3]) != 0)
+            break;
+    }
+#endif
+    for (; i < to; ++i)
+        if (IS_FREE_CLUSTER(fat[i]) == free)
+            return i;
+    return to;
+}
+
+/* @return how many of entries @param from to @param to of @param fat are
+ * free. */
+static uint16_t _fat_count_free(const uint32_t *fat, uint16_t from,
+                                uint16_t to) {
+    uint16_t i = from;
+    uint16_t count = 0;
+#ifdef __SSE2__
+    /* Matches compare to -1, subtracting them counts up per lane. */
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero;
+    for (; i + 4 <= to; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (fat + i));
+        sum = _mm_sub_epi32(sum, _mm_cmpeq_epi32(v, zero));
+    }
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    count = _mm_cvtsi128_si32(sum);
+#else
+    for (; i + 4 <= to; i += 4)
+        count += !fat[i] + !fat[i + 1] + !fat[i + 2] + !fat[i + 3];
+#endif
+    for (; i < to; ++i)
+        count += IS_FREE_CLUSTER(fat[i]);
+    return count;
+}
+
+/**
+ * Looks for a free cluster in @param first up to @param last (exclusive).
+ * Leaves the FAT sector of the cluster found in sdcard_sector.
+ * @return 0 if there is none. */
+static uint32_t _first_free(uint32_t first, uint32_t last) {
     uint32_t (*fat)[SD_SECTOR_SIZE / 4] = (uint32_t (*)[SD_SECTOR_SIZE / 4])
         sdcard_sector;
+    while (first < last) {
+        uint32_t base = first - first % (SD_SECTOR_SIZE / 4);
+        uint16_t to = SD_SECTOR_SIZE / 4;
+        if (last - base < to)
+            to = last - base;
+        if (!_read_sector(FAT_SECTOR(base), sdcard_sector))
+            return 0;
+        uint16_t i = _fat_find(*fat, first - base, to, true);
+        if (i < to)
+            return base + i;
+        first = base + to;
+    }
+    return 0;
+}
 
-    uint32_t i = fat32_root_cluster + 1;
-    _read_sector(sector, sdcard_sector);
-    while (!IS_FREE_CLUSTER((*fat)[i % (SD_SECTOR_SIZE / 4)])) {
-        i++;
-        if (i % (SD_SECTOR_SIZE / 4) == 0) {
-            _read_sector(++sector, sdcard_sector);
+/**
+ * Scans the FAT for a free cluster from @param from on, wrapping around
+ * once.  Leaves the FAT sector of the cluster found in sdcard_sector.
+ * @return 0 if the volume is full. */
+static uint32_t _find_free_cluster(uint32_t from) {
+    uint32_t end = fat32_cluster_count + 2;
+    if (from < fat32_root_cluster + 1 || from >= end)
+        from = fat32_root_cluster + 1;
+    uint32_t i = _first_free(from, end);
+    return i ? i : _first_free(2, from);
+}
+
+void fat32_set_au_size(uint32_t sectors) {
+    fat32_au_clusters = 0;
+    if (sectors <= fat32_sectors_per_cluster)
+        return;
+    fat32_au_clusters = sectors / fat32_sectors_per_cluster;
+    /* First cluster starting on or after an AU boundary. */
+    uint32_t skew = (sectors - fat32_data_start % sectors) % sectors;
+    _au_first = 2 + (skew + fat32_sectors_per_cluster - 1)
+        / fat32_sectors_per_cluster;
+#ifdef FAT32_SNAPSHOT
+    /* Resume where the snapshot left off if it was taken with this size. */
+    if (fat32_au_clusters == _au_resume)
+        return;
+#endif
+    _au_next = _au_first;
+    _au_fill = _au_first;
+}
+
+/**
+ * @return true if all @param count clusters from @param first on are
+ * free. */
+static bool _range_free(uint32_t first, uint32_t count) {
+    uint32_t (*fat)[SD_SECTOR_SIZE / 4] = (uint32_t (*)[SD_SECTOR_SIZE / 4])
+        sdcard_sector;
+    uint32_t last = first + count;
+    while (first < last) {
+        uint32_t base = first - first % (SD_SECTOR_SIZE / 4);
+        uint16_t to = SD_SECTOR_SIZE / 4;
+        if (last - base < to)
+            to = last - base;
+        _read_sector(FAT_SECTOR(base), sdcard_sector);
+        if (_fat_find(*fat, first - base, to, false) < to)
+            return false;
+        first = base + to;
+    }
+    return true;
+}
+
+/**
+ * Looks for an allocation unit with nothing allocated in it, from the last
+ * one opened on and wrapping around once.
+ * @return its first cluster, 0 if every AU is in use. */
+static uint32_t _find_free_au(void) {
+    uint32_t end = fat32_cluster_count + 2;
+    if (end < _au_first + fat32_au_clusters)
+        return 0;
+    uint32_t count = (end - _au_first) / fat32_au_clusters;
+    uint32_t au = (_au_next - _au_first) / fat32_au_clusters % count;
+    for (uint32_t tried = 0; tried < count; ++tried) {
+        uint32_t first = _au_first + au * fat32_au_clusters;
+        if (_range_free(first, fat32_au_clusters)) {
+            _au_next = first + fat32_au_clusters;
+            return first;
         }
+        au = (au + 1) % count;
     }
-    (*fat)[i % (SD_SECTOR_SIZE / 4)] = 0xffffffff;
-    sdcard_write_sector(sector, sdcard_sector);
+    return 0;
+}
+
+/**
+ * Like _find_free_cluster() from fat32_free_hint on, but moves the hint
+ * past the cluster found: nothing below it is free. */
+static uint32_t _find_free(void) {
+    uint32_t i = _find_free_cluster(fat32_free_hint);
+    if (i)
+        fat32_free_hint = i + 1;
     return i;
 }
 
+/**
+ * Picks the cluster new file data goes to: when fat32_set_au_size() was
+ * called the next one of the AU being filled, or the beginning of the
+ * next empty AU, else the first free cluster from the hint on.  Leaves
+ * its FAT sector in sdcard_sector.
+ * @return 0 if the volume is full. */
+static uint32_t _find_data_cluster(void) {
+    uint32_t (*fat)[SD_SECTOR_SIZE / 4] = (uint32_t (*)[SD_SECTOR_SIZE / 4])
+        sdcard_sector;
+    if (fat32_au_clusters) {
+        if (_au_fill < _au_next) {
+            _read_sector(FAT_SECTOR(_au_fill), sdcard_sector);
+            if (IS_FREE_CLUSTER((*fat)[_au_fill % (SD_SECTOR_SIZE / 4)]))
+                return _au_fill;
+        }
+        _au_fill = _find_free_au();
+        if (_au_fill) {
+            _read_sector(FAT_SECTOR(_au_fill), sdcard_sector);
+            return _au_fill;
+        }
+    }
+    return _find_free();
+}
+
+#ifdef FAT32_DISCARD
+void fat32_defer_discard(bool defer) {
+    _discard_defer = defer;
+}
+
+Fat32Error fat32_discard(void) {
+    Fat32Error err = FAT32_OK;
+    for (uint8_t i = 0; i < _discard_runs; ++i) {
+        uint32_t first = SECTOR(_discard_first[i], 0);
+        uint32_t count = _discard_count[i] * fat32_sectors_per_cluster;
+#ifdef FAT32_READ_AHEAD
+        /* Prefetched copies would outlive the erase. */
+        for (uint8_t j = 0; j < _ra_count; ++j)
+            if (_ra_sector[j] - first < count)
+                _ra_sector[j] = 0;
+#endif
+        if (!sdcard_erase_sectors(first, count))
+            err = FAT32_GENERIC_SD_ERROR;
+    }
+    _discard_runs = 0;
+    return err;
+}
+
+/**
+ * Queues the @param count clusters from @param first on for erasing,
+ * growing a pending run where they touch one. */
+static void _discard_run(uint32_t first, uint32_t count) {
+    for (uint8_t i = 0; i < _discard_runs; ++i) {
+        if (first == _discard_first[i] + _discard_count[i]) {
+            _discard_count[i] += count;
+            return;
+        }
+        if (first + count == _discard_first[i]) {
+            _discard_first[i] = first;
+            _discard_count[i] += count;
+            return;
+        }
+    }
+    if (_discard_runs == FAT32_DISCARD)
+        fat32_discard();
+    _discard_first[_discard_runs] = first;
+    _discard_count[_discard_runs++] = count;
+}
+
+/**
+ * @param cluster is about to be handed out again, a pending erase must not
+ * hit the new data. */
+static void _discard_reuse(uint32_t cluster) {
+    for (uint8_t i = 0; i < _discard_runs; ++i) {
+        if (cluster - _discard_first[i] < _discard_count[i]) {
+            fat32_discard();
+            return;
+        }
+    }
+}
+#endif
+
+/**
+ * Puts @param free_count and fat32_free_hint into the FSInfo sector, with
+ * FAT32_SNAPSHOT a snapshot along with a known count or, with an unknown
+ * one, a new generation that makes the old snapshot stale. */
+static Fat32Error _write_fsinfo(uint32_t free_count) {
+    if (!_read_sector(_fsinfo_sector, sdcard_sector))
+        return FAT32_GENERIC_SD_ERROR;
+    Fat32FsInfo *info = (Fat32FsInfo *) sdcard_sector;
+    info->free_count = free_count;
+    info->next_free = fat32_free_hint;
+#ifdef FAT32_SNAPSHOT
+    if (free_count == FSINFO_UNKNOWN)
+        info->generation++;
+    else
+        _snapshot_take(info);
+    _snapshot_live = free_count != FSINFO_UNKNOWN;
+#endif
+    _write_sector(_fsinfo_sector, sdcard_sector);
+    _fsinfo_free = free_count;
+    return FAT32_OK;
+}
+
+Fat32Error fat32_update_fsinfo(void) {
+    if (!_fsinfo_sector)
+        return FAT32_OK;
+    return _write_fsinfo(fat32_free_count);
+}
+
+#ifdef FAT32_SNAPSHOT
+/* The FAT or the root directory is about to change, the snapshot on the
+ * card has to go stale before it does.  Uses sdcard_sector. */
+static void _snapshot_stale(void) {
+    if (_snapshot_live && _fsinfo_sector)
+        _write_fsinfo(FSINFO_UNKNOWN);
+}
+#else
+#define _snapshot_stale()
+#endif
+
+/**
+ * Books @param change clusters sharing the FAT sector of @param cluster as
+ * freed (positive) or claimed (negative).  The first change marks the
+ * count on the card unknown, a crash must not leave a wrong one behind
+ * for the next mount to trust.  Uses sdcard_sector. */
+static void _free_changed(uint32_t cluster, int32_t change) {
+    if (fat32_free_count != FSINFO_UNKNOWN)
+        fat32_free_count += change;
+    if (cluster < _scan_pos)
+        _scan_free += change;
+    if (_fsinfo_free != FSINFO_UNKNOWN)
+        _write_fsinfo(FSINFO_UNKNOWN);
+}
+
+bool fat32_scan_free(uint16_t max_sectors) {
+    uint32_t (*fat)[SD_SECTOR_SIZE / 4] = (uint32_t (*)[SD_SECTOR_SIZE / 4])
+        sdcard_sector;
+    uint32_t end = fat32_cluster_count + 2;
+    if (_scan_pos >= end)
+        return true;
+    while (max_sectors--) {
+        if (!_read_sector(FAT_SECTOR(_scan_pos), sdcard_sector))
+            return false;
+        uint32_t base = _scan_pos - _scan_pos % (SD_SECTOR_SIZE / 4);
+        uint16_t to = SD_SECTOR_SIZE / 4;
+        if (end - base < to)
+            to = end - base;
+        _scan_free += _fat_count_free(*fat, _scan_pos - base, to);
+        _scan_pos = base + to;
+        if (_scan_pos == end) {
+            fat32_free_count = _scan_free;
+            if (_fsinfo_sector && _fsinfo_free != fat32_free_count)
+                _write_fsinfo(fat32_free_count);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Claims a free cluster, one for file data if @param data is set.
+ * @return 0 if the volume is full. */
+static uint32_t _claim(bool data) {
+    uint32_t (*fat)[SD_SECTOR_SIZE / 4] = (uint32_t (*)[SD_SECTOR_SIZE / 4])
+        sdcard_sector;
+    _snapshot_stale();
+    uint32_t i = data ? _find_data_cluster() : _find_free();
+    if (!i)
+        return 0;
+#ifdef FAT32_DISCARD
+    _discard_reuse(i);
+#endif
+    (*fat)[i % (SD_SECTOR_SIZE / 4)] = 0x0fffffff;
+    if (i == _au_fill)
+        _au_fill = i + 1;
+    _write_sector(FAT_SECTOR(i), sdcard_sector);
+    _free_changed(i, -1);
+    return i;
+}
+
+uint32_t fat32_claim_free_cluster(void) {
+    return _claim(false);
+}
+
+/**
+ * Claims a free cluster and links it behind @param tail.  The cluster
+ * right after the tail is preferred, which keeps files contiguous and
+ * needs a single FAT write.  Otherwise file data (@param data) goes where
+ * _find_data_cluster() says.
+ * @return 0 if the volume is full. */
+static uint32_t _claim_after(uint32_t tail, bool data) {
+    uint32_t (*fat)[SD_SECTOR_SIZE / 4] = (uint32_t (*)[SD_SECTOR_SIZE / 4])
+        sdcard_sector;
+    _snapshot_stale();
+    uint32_t i = tail + 1;
+    bool next_free = false;
+    if (i < fat32_cluster_count + 2) {
+        _read_sector(FAT_SECTOR(i), sdcard_sector);
+        next_free = IS_FREE_CLUSTER((*fat)[i % (SD_SECTOR_SIZE / 4)]);
+    }
+    if (!next_free) {
+        i = data ? _find_data_cluster() : _find_free();
+        if (!i)
+            return 0;
+    }
+#ifdef FAT32_DISCARD
+    _discard_reuse(i);
+#endif
+    (*fat)[i % (SD_SECTOR_SIZE / 4)] = 0x0fffffff;
+    if (i == _au_fill)
+        _au_fill = i + 1;
+    if (FAT_SECTOR(i) == FAT_SECTOR(tail)) {
+        (*fat)[tail % (SD_SECTOR_SIZE / 4)] = i;
+        _write_sector(FAT_SECTOR(i), sdcard_sector);
+    } else {
+        _write_sector(FAT_SECTOR(i), sdcard_sector);
+        fat32_link_clusters(tail, i);
+    }
+    if (i == fat32_free_hint)
+        fat32_free_hint = i + 1;
+    _free_changed(i, -1);
+    return i;
+}
+
+/**
+ * Copies the @param count sectors from @param from on to @param to on,
+ * through the read-ahead pool with multi-block requests if there is one.
+ * @return false if a read failed. */
+static bool _copy_sectors(uint32_t from, uint32_t to, uint32_t count) {
+#ifdef FAT32_READ_AHEAD
+    _ra_count = 0;
+    _ra_owner = NULL;
+#endif
+    while (count) {
+#ifdef FAT32_READ_AHEAD
+        uint8_t n = count < FAT32_READ_AHEAD ? count : FAT32_READ_AHEAD;
+        if (!_read_sectors(from, n, _ra_buf[0]))
+            return false;
+        _write_sectors(to, n, _ra_buf[0]);
+#else
+        uint8_t n = 1;
+        if (!_read_sector(from, sdcard_sector))
+            return false;
+        _write_sector(to, sdcard_sector);
+#endif
+        from += n;
+        to += n;
+        count -= n;
+    }
+    return true;
+}
+
+/**
+ * Claims @param count free clusters, searching on from right behind
+ * @param tail, and chains them up behind it.  Each FAT sector passed is
+ * read and written once, only where the chain crosses into the next one
+ * the link costs another write.  Uses sdcard_sector.
+ * @return false if the volume ran full, what was claimed stays linked. */
+static bool _extend_chain(uint32_t tail, uint32_t count) {
+    uint32_t (*fat)[SD_SECTOR_SIZE / 4] = (uint32_t (*)[SD_SECTOR_SIZE / 4])
+        sdcard_sector;
+    _snapshot_stale();
+    uint32_t end = fat32_cluster_count + 2;
+    uint32_t start = tail;
+    uint32_t sector = FAT_SECTOR(tail);
+    bool dirty = false;
+    uint32_t claimed_in = 0;  /* A cluster claimed in sector. */
+    int32_t claimed = 0;
+    if (!_read_sector(sector, sdcard_sector))
+        return false;
+    for (uint32_t i = tail + 1; count && i != start; ++i) {
+        if (i == end) {
+            i = 1;
+            continue;
+        }
+        if (FAT_SECTOR(i) != sector) {
+            if (dirty)
+                _write_sector(sector, sdcard_sector);
+            if (claimed)
+                _free_changed(claimed_in, -claimed);
+            dirty = false;
+            claimed = 0;
+            sector = FAT_SECTOR(i);
+            _read_sector(sector, sdcard_sector);
+        }
+        /* Skip what is taken in this sector in one go, stopping at the
+         * end of the volume and where the search started. */
+        uint32_t base = i - i % (SD_SECTOR_SIZE / 4);
+        uint16_t to = SD_SECTOR_SIZE / 4;
+        if (end - base < to)
+            to = end - base;
+        if (start >= i && start - base < to)
+            to = start - base;
+        uint16_t k = _fat_find(*fat, i - base, to, true);
+        if (k == to) {
+            i = base + to - 1;
+            continue;
+        }
+        i = base + k;
+#ifdef FAT32_DISCARD
+        _discard_reuse(i);
+#endif
+        if (FAT_SECTOR(tail) != sector) {
+            fat32_link_clusters(tail, i);
+            _read_sector(sector, sdcard_sector);
+        } else {
+            (*fat)[tail % (SD_SECTOR_SIZE / 4)] = i;
+        }
+        (*fat)[i % (SD_SECTOR_SIZE / 4)] = 0x0fffffff;
+        dirty = true;
+        if (i == _au_fill)
+            _au_fill = i + 1;
+        if (i == fat32_free_hint)
+            fat32_free_hint = i + 1;
+        claimed_in = i;
+        claimed++;
+        tail = i;
+        count--;
+    }
+    if (dirty)
+        _write_sector(sector, sdcard_sector);
+    if (claimed)
+        _free_changed(claimed_in, -claimed);
+    return count == 0;
+}
+
+/**
+ * Follows the chain from @param cluster as long as it goes on to the very
+ * next cluster, within the FAT sector of @param cluster.  @param next gets
+ * the cluster behind the run.  Uses sdcard_sector.
+ * @return length of the run in clusters, 0 if the FAT could not be read. */
+static uint32_t _chain_run(uint32_t cluster, uint32_t *next) {
+    uint32_t (*fat)[SD_SECTOR_SIZE / 4] = (uint32_t (*)[SD_SECTOR_SIZE / 4])
+        sdcard_sector;
+    uint32_t count = 1;
+    if (!_read_sector(FAT_SECTOR(cluster), sdcard_sector))
+        return 0;
+    while ((*next = (*fat)[cluster % (SD_SECTOR_SIZE / 4)] & 0x0fffffff)
+           == cluster + 1 && FAT_SECTOR(*next) == FAT_SECTOR(cluster)) {
+        cluster++;
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Frees the chain starting at @param cluster, or only what follows it if
+ * @param keep_first is set, which then ends the chain.  Clusters sharing a
+ * FAT sector cost one read and one write between them and get queued for
+ * erasing.  Uses sdcard_sector. */
+static void _free_chain(uint32_t cluster, bool keep_first) {
+    uint32_t (*fat)[SD_SECTOR_SIZE / 4] = (uint32_t (*)[SD_SECTOR_SIZE / 4])
+        sdcard_sector;
+    _snapshot_stale();
+    uint32_t sector = 0;
+    bool dirty = false;
+    uint32_t freed_in = 0;    /* A cluster freed in sector. */
+    int32_t freed = 0;
+#ifdef FAT32_DISCARD
+    uint32_t run_first = cluster;
+    uint32_t run_count = 0;
+#endif
+    while (IS_VALID_CLUSTER(cluster)) {
+        if (FAT_SECTOR(cluster) != sector) {
+            if (dirty)
+                _write_sector(sector, sdcard_sector);
+            if (freed)
+                _free_changed(freed_in, freed);
+            dirty = false;
+            freed = 0;
+            sector = FAT_SECTOR(cluster);
+            _read_sector(sector, sdcard_sector);
+        }
+        uint32_t *entry = &(*fat)[cluster % (SD_SECTOR_SIZE / 4)];
+        uint32_t next_cluster = *entry & 0x0fffffff;
+        if (keep_first) {
+            /* Already the end of the chain, nothing to free. */
+            if (!IS_VALID_CLUSTER(next_cluster))
+                return;
+            *entry = 0x0fffffff;
+            dirty = true;
+            keep_first = false;
+#ifdef FAT32_DISCARD
+            run_first = next_cluster;
+#endif
+            cluster = next_cluster;
+            continue;
+        }
+#ifdef FAT32_DISCARD
+        if (cluster != run_first + run_count) {
+            _discard_run(run_first, run_count);
+            run_first = cluster;
+            run_count = 0;
+        }
+        run_count++;
+#endif
+        *entry = 0;               /* mark free */
+        dirty = true;
+        freed_in = cluster;
+        freed++;
+        if (cluster < fat32_free_hint)
+            fat32_free_hint = cluster;
+        cluster = next_cluster;
+    }
+    if (dirty)
+        _write_sector(sector, sdcard_sector);
+    if (freed)
+        _free_changed(freed_in, freed);
+#ifdef FAT32_DISCARD
+    if (run_count)
+        _discard_run(run_first, run_count);
+#endif
+}
+
+/**
+ * Frees the @param count chains starting at @param heads (which end up
+ * cleared) together.  Each round takes the lowest FAT sector any of them
+ * is in and frees everything they have there, so FAT sectors are written
+ * in ascending order and chains sharing one cost a single read and write
+ * between them.  Uses sdcard_sector. */
+static void _free_chains(uint32_t *heads, uint8_t count) {
+    uint32_t (*fat)[SD_SECTOR_SIZE / 4] = (uint32_t (*)[SD_SECTOR_SIZE / 4])
+        sdcard_sector;
+    _snapshot_stale();
+    for (;;) {
+        uint32_t sector = 0;
+        for (uint8_t i = 0; i < count; ++i)
+            if (IS_VALID_CLUSTER(heads[i])
+                && (!sector || FAT_SECTOR(heads[i]) < sector))
+                sector = FAT_SECTOR(heads[i]);
+        if (!sector || !_read_sector(sector, sdcard_sector))
+            return;
+        uint32_t freed_in = 0;
+        int32_t freed = 0;
+        for (uint8_t i = 0; i < count; ++i) {
+            while (IS_VALID_CLUSTER(heads[i])
+                   && FAT_SECTOR(heads[i]) == sector) {
+                uint32_t *entry = &(*fat)[heads[i] % (SD_SECTOR_SIZE / 4)];
+#ifdef FAT32_DISCARD
+                _discard_run(heads[i], 1);
+#endif
+                if (heads[i] < fat32_free_hint)
+                    fat32_free_hint = heads[i];
+                freed_in = heads[i];
+                freed++;
+                heads[i] = *entry & 0x0fffffff;
+                *entry = 0;       /* mark free */
+            }
+        }
+        _write_sector(sector, sdcard_sector);
+        _free_changed(freed_in, freed);
+    }
+}
+
+/**
+ * Looks for @param count free clusters in a row, lowest first, in one
+ * more FAT sector from _defrag_scan on.  A run found so far carries over
+ * to the next call.  Uses sdcard_sector.
+ * @return the first of them, 0 if not found yet. */
+static uint32_t _find_free_run(uint32_t count) {
+    uint32_t (*fat)[SD_SECTOR_SIZE / 4] = (uint32_t (*)[SD_SECTOR_SIZE / 4])
+        sdcard_sector;
+    uint32_t end = fat32_cluster_count + 2;
+    uint32_t base = _defrag_scan;
+    uint16_t to = SD_SECTOR_SIZE / 4;
+    if (end - base < to)
+        to = end - base;
+    _defrag_scan = base + to;
+    if (!_read_sector(FAT_SECTOR(base), sdcard_sector)) {
+        _defrag_run = 0;
+        return 0;
+    }
+    /* Hop from free to used entry and back instead of one by one. */
+    uint16_t i = base ? 0 : 2;
+    while (i < to) {
+        if (!_defrag_run) {
+            i = _fat_find(*fat, i, to, true);
+            if (i == to)
+                break;
+            _defrag_run_first = base + i;
+        }
+        uint16_t used = _fat_find(*fat, i, to, false);
+        _defrag_run += used - i;
+        if (_defrag_run >= count)
+            return _defrag_run_first;
+        if (used == to)
+            break;                /* The run may go on in the next sector. */
+        _defrag_run = 0;
+        i = used + 1;
+    }
+    return 0;
+}
+
+/**
+ * Claims the free clusters from @param first on as one chain of
+ * @param count, with one read and write per FAT sector.  Uses
+ * sdcard_sector. */
+static void _claim_run(uint32_t first, uint32_t count) {
+    uint32_t (*fat)[SD_SECTOR_SIZE / 4] = (uint32_t (*)[SD_SECTOR_SIZE / 4])
+        sdcard_sector;
+    _snapshot_stale();
+    uint32_t end = first + count;
+    uint32_t i = first;
+    while (i < end) {
+        uint32_t sector = FAT_SECTOR(i);
+        uint32_t from = i;
+        _read_sector(sector, sdcard_sector);
+        do {
+#ifdef FAT32_DISCARD
+            _discard_reuse(i);
+#endif
+            (*fat)[i % (SD_SECTOR_SIZE / 4)] = i + 1 < end ? i + 1 : 0x0fffffff;
+        } while (++i < end && i % (SD_SECTOR_SIZE / 4));
+        _write_sector(sector, sdcard_sector);
+        _free_changed(from, -(int32_t) (i - from));
+    }
+    if (fat32_free_hint - first < count)
+        fat32_free_hint = end;
+    if (_au_fill - first < count)
+        _au_fill = end;
+}
+
+/**
+ * @param file is about to change, a copy fat32_defrag() is making of it
+ * would be stale. */
+static void _defrag_forget(Fat32File *file) {
+    if (_defrag_cand && file->starting_cluster == _defrag_cand)
+        _defrag_cand = 0;
+    if (_defrag_from && file->starting_cluster == _defrag_from) {
+        _defrag_from = 0;
+        _defrag_moved = true;     /* Worth another look next pass. */
+        _free_chain(_defrag_to, false);
+    }
+}
+
+/* The root directory is about to be rearranged, fat32_defrag() starts its
+ * pass over and drops a copy it is making.  Uses sdcard_sector. */
+static void _defrag_restart(void) {
+    _defrag_dir = 0;
+    _defrag_cand = 0;
+    if (_defrag_from) {
+        _defrag_from = 0;
+        _defrag_moved = true;
+        _free_chain(_defrag_to, false);
+    }
+}
+
 Fat32Error fat32_link_clusters(uint32_t head, uint32_t tail) {
     uint32_t sector = fat32_fat_start + head / (SD_SECTOR_SIZE / 4);
     if(!_read_sector(sector, sdcard_sector))
@@ -147,10 +1142,197 @@ Fat32Error fat32_link_clusters(uint32_t head, uint32_t tail) {
     uint32_t (*fat)[SD_SECTOR_SIZE / 4] = (uint32_t (*)[SD_SECTOR_SIZE / 4])
         sdcard_sector;
     (*fat)[head] = tail;
-    sdcard_write_sector(sector, sdcard_sector);
+    _write_sector(sector, sdcard_sector);
     return FAT32_OK;
 }
 
+static void _zero_cluster(uint32_t cluster) {
+    memset(sdcard_sector, 0, SD_SECTOR_SIZE);
+    for (uint8_t i = 0; i < fat32_sectors_per_cluster; ++i)
+        _write_sector(SECTOR(cluster, i), sdcard_sector);
+}
+
+/* Forget everything cached about @param file, it was just (re)opened. */
+static void _open_handle(Fat32File *file) {
+    file->cluster = 0;
+    file->cluster_pos = 0;
+    file->run = 0;
+    file->buffer = NULL;
+    file->buffer_sector = 0;
+    file->buffer_dirty = false;
+    file->entry_dirty = false;
+#ifdef FAT32_READ_AHEAD
+    file->ra_expect = 0;
+    file->ra_next = 0;
+    file->ra_window = 0;
+#endif
+#ifdef FAT32_OPEN_FILES
+    file->shared = 0;
+#endif
+}
+
+#ifdef FAT32_OPEN_FILES
+/* Brings @param file up to date with the record it shares. */
+static void _shared_in(Fat32File *file) {
+    if (!file->shared)
+        return;
+    Fat32Shared *shared = &_shared[file->shared - 1];
+    file->exists = shared->exists;
+    memcpy(file->name, shared->name, sizeof (file->name));
+    file->attr = shared->attr;
+    file->starting_cluster = shared->starting_cluster;
+    file->file_size = shared->file_size;
+    file->entry_sector = shared->entry_sector;
+    file->entry_offset = shared->entry_offset;
+    /* Start from where another handle got to if that is closer. */
+    if (shared->cluster && shared->cluster_pos <= file->cursor
+        && (!file->cluster || file->cluster_pos > file->cursor
+            || file->cluster_pos < shared->cluster_pos)) {
+        file->cluster = shared->cluster;
+        file->cluster_pos = shared->cluster_pos;
+        file->run = shared->run;
+#ifdef FAT32_READ_AHEAD
+        file->ra_next = 0;
+#endif
+    }
+}
+
+/* Hands what @param file changed or found out on to the others. */
+static void _shared_out(Fat32File *file) {
+    if (!file->shared)
+        return;
+    Fat32Shared *shared = &_shared[file->shared - 1];
+    shared->exists = file->exists;
+    memcpy(shared->name, file->name, sizeof (shared->name));
+    shared->attr = file->attr;
+    shared->starting_cluster = file->exists ? file->starting_cluster : 0;
+    shared->file_size = file->exists ? file->file_size : 0;
+    shared->entry_sector = file->entry_sector;
+    shared->entry_offset = file->entry_offset;
+    if (file->cluster) {
+        shared->cluster = file->cluster;
+        shared->cluster_pos = file->cluster_pos;
+        shared->run = file->run;
+    }
+}
+
+/**
+ * The chain of @param file is about to change.  The other handles on it
+ * write out what they hold back (or drop it if the file is @param gone)
+ * and forget where in the chain they are. */
+static void _shared_siblings(Fat32File *file, bool gone) {
+    if (!file->shared)
+        return;
+    for (uint8_t i = 0; i < FAT32_OPEN_FILES; ++i) {
+        Fat32File *other = &_open_files[i];
+        if (other == file || other->shared != file->shared)
+            continue;
+        if (gone)
+            other->entry_dirty = false;
+        else if (other->buffer && other->buffer_dirty)
+            _write_sector(other->buffer_sector, other->buffer);
+        other->buffer_dirty = false;
+        other->buffer_sector = 0;
+        other->cluster = 0;
+        other->run = 0;
+#ifdef FAT32_READ_AHEAD
+        other->ra_next = 0;
+#endif
+    }
+    _shared[file->shared - 1].cluster = 0;
+}
+
+/* @return true if a handle still holds back data or the directory entry
+ * of the file at @param cluster. */
+static bool _shared_dirty(uint32_t cluster) {
+    for (uint8_t i = 0; i < FAT32_OPEN_FILES; ++i)
+        if (_open_files[i].shared
+            && (_open_files[i].buffer_dirty || _open_files[i].entry_dirty)
+            && _open_files[i].starting_cluster == cluster)
+            return true;
+    return false;
+}
+
+/* The file at cluster @param from now lives at @param to. */
+static void _shared_moved(uint32_t from, uint32_t to) {
+    for (uint8_t i = 0; i < FAT32_OPEN_FILES; ++i) {
+        if (_shared[i].users && _shared[i].starting_cluster == from) {
+            _shared[i].starting_cluster = to;
+            _shared[i].cluster = 0;
+        }
+        Fat32File *file = &_open_files[i];
+        if (file->shared && file->starting_cluster == from) {
+            file->starting_cluster = to;
+            file->cluster = 0;
+            file->run = 0;
+            file->buffer_sector = 0;
+#ifdef FAT32_READ_AHEAD
+            file->ra_next = 0;
+#endif
+        }
+    }
+}
+
+/* A directory entry moved from @param sector / @param offset. */
+static void _shared_entry_moved(uint32_t sector, uint8_t offset,
+                                uint32_t to, uint8_t to_offset) {
+    for (uint8_t i = 0; i < FAT32_OPEN_FILES; ++i) {
+        if (_shared[i].users && _shared[i].entry_sector == sector
+            && _shared[i].entry_offset == offset) {
+            _shared[i].entry_sector = to;
+            _shared[i].entry_offset = to_offset;
+        }
+    }
+}
+
+/* The file whose directory entry is at @param sector / @param offset got
+ * deleted behind the back of its handles. */
+static void _shared_entry_gone(uint32_t sector, uint8_t offset) {
+    for (uint8_t i = 0; i < FAT32_OPEN_FILES; ++i) {
+        Fat32Shared *shared = &_shared[i];
+        if (!shared->users || !shared->exists
+            || shared->entry_sector != sector
+            || shared->entry_offset != offset)
+            continue;
+        shared->exists = false;
+        shared->starting_cluster = 0;
+        shared->file_size = 0;
+        shared->cluster = 0;
+        for (uint8_t j = 0; j < FAT32_OPEN_FILES; ++j) {
+            Fat32File *file = &_open_files[j];
+            if (file->shared != i + 1)
+                continue;
+            file->entry_dirty = false;
+            file->buffer_dirty = false;
+            file->buffer_sector = 0;
+            file->cluster = 0;
+            file->run = 0;
+#ifdef FAT32_READ_AHEAD
+            file->ra_next = 0;
+#endif
+        }
+    }
+}
+#else
+#define _shared_in(F)
+#define _shared_out(F)
+#endif
+
+/**
+ * Opens @param file on @param fs_entry, which lies in sdcard_sector read
+ * from @param sector.  The name has to be copied already. */
+static void _entry_handle(Fat32File *file, const Fat32Entry *fs_entry,
+                          uint32_t sector) {
+    file->exists = true;
+    file->attr = fs_entry->attributes;
+    file->file_size = fs_entry->file_size;
+    file->starting_cluster = ENTRY_CLUSTER(fs_entry);
+    file->entry_sector = sector;
+    file->entry_offset =
+        ((const uint8_t *) fs_entry - sdcard_sector) / sizeof (Fat32Entry);
+    _open_handle(file);
+}
+
 Fat32Error fat32_get_nth_file(Fat32File *file, uint32_t n) {
     file->exists = false;
     uint8_t sector = 0;
@@ -164,13 +1346,7 @@ Fat32Error fat32_get_nth_file(Fat32File *file, uint32_t n) {
             /* Check if we have arrived. */
             if (n-- == 0) {
                 _copy_name(file->name, fs_entry->filename);
-                file->exists = true;
-                file->attr = fs_entry->attributes;
-                file->file_size = fs_entry->file_size;
-                file->starting_cluster = fs_entry->starting_cluster;
-                file->entry_sector = SECTOR(cluster, sector);
-                file->entry_offset =
-                    ((uint8_t *)fs_entry - sdcard_sector) / sizeof (Fat32Entry);
+                _entry_handle(file, fs_entry, SECTOR(cluster, sector));
                 return FAT32_OK;
             }
         }
@@ -180,7 +1356,7 @@ Fat32Error fat32_get_nth_file(Fat32File *file, uint32_t n) {
 
         /* Switch to next cluster/sector. */
         if ((uint8_t *) fs_entry >= (sdcard_sector + SD_SECTOR_SIZE)) {
-            if (sector++ == fat32_sectors_per_cluster) {
+            if (++sector == fat32_sectors_per_cluster) {
                 sector = 0;
                 cluster = fat32_get_next_cluster(cluster);
                 if (!IS_VALID_CLUSTER(cluster)) { /* We reached the end. */
@@ -208,13 +1384,7 @@ Fat32Error fat32_find_file(Fat32File *file, const char *filename) {
             _copy_name(file->name, fs_entry->filename);
             if (strcmp(file->name, filename) == 0) {
                 /* Found file. */
-                file->exists = true;
-                file->attr = fs_entry->attributes;
-                file->file_size = fs_entry->file_size;
-                file->starting_cluster = fs_entry->starting_cluster;
-                file->entry_sector = SECTOR(cluster, sector);
-                file->entry_offset =
-                    ((uint8_t *)fs_entry - sdcard_sector) / sizeof (Fat32Entry);
+                _entry_handle(file, fs_entry, SECTOR(cluster, sector));
                 return FAT32_OK;
             } else {
                 /* File miss.  Clear the name we used for comparing. */
@@ -227,7 +1397,7 @@ Fat32Error fat32_find_file(Fat32File *file, const char *filename) {
 
         /* Switch to next cluster/sector. */
         if ((uint8_t *) fs_entry >= (sdcard_sector + SD_SECTOR_SIZE)) {
-            if (sector++ == fat32_sectors_per_cluster) {
+            if (++sector == fat32_sectors_per_cluster) {
                 sector = 0;
                 cluster = fat32_get_next_cluster(cluster);
                 if (!IS_VALID_CLUSTER(cluster)) { /* We reached the end. */
@@ -241,130 +1411,1069 @@ Fat32Error fat32_find_file(Fat32File *file, const char *filename) {
     return FAT32_INVALID_FILE;
 }
 
-uint16_t fat32_read_file(Fat32File *file, char *buf, uint16_t len) {
-    uint8_t sector = file->cursor / SD_SECTOR_SIZE;
-    uint16_t offset = file->cursor % SD_SECTOR_SIZE;
-    uint32_t cluster = file->starting_cluster +
-        (sector / fat32_sectors_per_cluster);
-    sector %= fat32_sectors_per_cluster;
-
-    _read_sector(SECTOR(cluster, sector), sdcard_sector);
+uint32_t fat32_list(Fat32Filter visit, void *ctx) {
+    Fat32File file;
+    uint32_t n = 0;
+    uint8_t sector = 0;
+    uint32_t cluster = fat32_root_cluster;
+    if (!_read_sector(SECTOR(cluster, sector), sdcard_sector))
+        return 0;
+    Fat32Entry *fs_entry = (Fat32Entry *) sdcard_sector;
+    while (fs_entry->filename[0]) {
+        if (fs_entry->filename[0] != '\xe5'
+            && !IS_NAME_EXT(fs_entry->attributes)) {
+            memset(file.name, 0, sizeof (file.name));
+            _copy_name(file.name, fs_entry->filename);
+            _entry_handle(&file, fs_entry, SECTOR(cluster, sector));
+            n++;
+            if (!visit(&file, ctx))
+                return n;
+        }
 
-    if (len > (file->file_size - file->cursor)) {
-        len = (file->file_size - file->cursor);
-    }
+        fs_entry++;
 
-    for (uint16_t i = 0; i < len; ++i) {
-        if ((offset + (i % SD_SECTOR_SIZE)) == SD_SECTOR_SIZE) {
-            sector++;
-            offset = 0;
-            if (sector == fat32_sectors_per_cluster) {
+        if ((uint8_t *) fs_entry >= (sdcard_sector + SD_SECTOR_SIZE)) {
+            if (++sector == fat32_sectors_per_cluster) {
+                sector = 0;
                 cluster = fat32_get_next_cluster(cluster);
                 if (!IS_VALID_CLUSTER(cluster))
-                    return i;
-                sector = 0;
+                    return n;
             }
             _read_sector(SECTOR(cluster, sector), sdcard_sector);
+            fs_entry = (Fat32Entry *) sdcard_sector;
         }
-        buf[i] = sdcard_sector[offset + (i % SD_SECTOR_SIZE)];
-        file->cursor++;
     }
-    
-    return len;
+    return n;
 }
 
-Fat32Error fat32_write_file(Fat32File *file, const char *buf, uint16_t len) {
-    uint8_t sector = file->cursor / SD_SECTOR_SIZE;
-    uint16_t offset = file->cursor % SD_SECTOR_SIZE;
-    uint32_t cluster = file->starting_cluster +
-        (sector / fat32_sectors_per_cluster);
-    sector %= fat32_sectors_per_cluster;
+/**
+ * Looks up the cluster behind file->cluster and, with the same FAT read,
+ * how many follow it contiguously (into file->run).
+ * @return the next cluster, an end of chain or error value if none. */
+static uint32_t _next_cluster(Fat32File *file) {
+    uint32_t next;
+    uint32_t run = _chain_run(file->cluster, &next);
+    if (!run)
+        return -1;
+    file->run = run - 1;
+    return run > 1 ? file->cluster + 1 : next;
+}
 
-    _read_sector(SECTOR(cluster, sector), sdcard_sector);
+/**
+ * Walks the chain of @param file up to the cluster holding byte @param pos,
+ * starting from the cached cluster if that one lies before.
+ * @return an invalid cluster if the chain ends before, the cache then
+ * holds the last cluster. */
+static uint32_t _cluster_at(Fat32File *file, uint32_t pos) {
+    uint32_t cluster_size = SD_SECTOR_SIZE * fat32_sectors_per_cluster;
+    if (!IS_VALID_CLUSTER(file->cluster) || pos < file->cluster_pos) {
+        file->cluster = file->starting_cluster;
+        file->cluster_pos = 0;
+        file->run = 0;
+#ifdef FAT32_READ_AHEAD
+        file->ra_next = 0;
+#endif
+    }
+    while (pos - file->cluster_pos >= cluster_size) {
+        if (!file->run) {
+#ifdef FAT32_READ_AHEAD
+            uint32_t next = file->ra_next;
+            file->ra_next = 0;
+            if (!next)
+                next = _next_cluster(file);
+#else
+            uint32_t next = _next_cluster(file);
+#endif
+            if (!file->run) {
+                /* Stay on the last cluster, appending continues there. */
+                if (!IS_VALID_CLUSTER(next))
+                    return next;
+                file->cluster = next;
+                file->cluster_pos += cluster_size;
+                continue;
+            }
+        }
+        /* Inside a known run the next clusters need no FAT read. */
+        uint32_t skip = (pos - file->cluster_pos) / cluster_size;
+        if (skip > file->run)
+            skip = file->run;
+        file->cluster += skip;
+        file->cluster_pos += skip * cluster_size;
+        file->run -= skip;
+#ifdef FAT32_READ_AHEAD
+        file->ra_next = 0;
+#endif
+    }
+    return file->cluster;
+}
 
-    for (uint16_t i = 0; i < len; ++i) {
-        if ((offset + (i % SD_SECTOR_SIZE)) == SD_SECTOR_SIZE) {
-            sdcard_write_sector(SECTOR(cluster, sector),
-                                sdcard_sector);
-            sector++;
-            offset = 0;
-            if (sector == fat32_sectors_per_cluster) {
-                uint32_t next_cluster = fat32_get_next_cluster(cluster);
-                if (!IS_VALID_CLUSTER(next_cluster)) {
-                    next_cluster = fat32_claim_free_cluster();
-                    fat32_link_clusters(cluster, next_cluster);
-                }
-                cluster = next_cluster;
-                sector = 0;
+#ifdef FAT32_READ_AHEAD
+/**
+ * Refills the pool with @param file's window of sectors, starting at
+ * @param sector of @param cluster and running at most into the next
+ * cluster, whose number gets remembered on the way. */
+static void _ra_fill(Fat32File *file, uint32_t cluster, uint8_t sector) {
+    /* Widen the window while prefetches get used up, narrow it when
+     * most of one went to waste. */
+    if (_ra_owner == file && _ra_count) {
+        if (_ra_seen == _ra_count && file->ra_window <= FAT32_READ_AHEAD / 2)
+            file->ra_window *= 2;
+        else if (_ra_seen * 2 < _ra_count && file->ra_window > 1)
+            file->ra_window /= 2;
+    }
+    _ra_owner = file;
+    _ra_count = 0;
+    _ra_seen = 0;
+
+    while (_ra_count < file->ra_window) {
+        uint8_t n = fat32_sectors_per_cluster - sector;
+        if (n > file->ra_window - _ra_count)
+            n = file->ra_window - _ra_count;
+        if (!_read_sectors(SECTOR(cluster, sector), n, _ra_buf[_ra_count]))
+            return;
+        for (uint8_t i = 0; i < n; ++i)
+            _ra_sector[_ra_count++] = SECTOR(cluster, sector + i);
+        if (_ra_count == file->ra_window || cluster != file->cluster)
+            return;
+        /* Look up the next FAT entry now rather than at the boundary. */
+        cluster = file->run ? cluster + 1 : _next_cluster(file);
+        if (!IS_VALID_CLUSTER(cluster))
+            return;
+        file->ra_next = cluster;
+        sector = 0;
+    }
+}
+#endif
+
+#ifdef FAT32_READ_AHEAD
+/* Carrying on where the last read stopped turns read-ahead on. */
+static void _ra_follow(Fat32File *file) {
+    if (file->cursor != file->ra_expect)
+        file->ra_window = 0;
+    else if (!file->ra_window)
+        file->ra_window = FAT32_READ_AHEAD < 2 ? 1 : 2;
+}
+#endif
+
+/**
+ * @return the contents of @param sector of @param cluster, served from the
+ * read-ahead pool when possible. */
+static const uint8_t *_data_sector(Fat32File *file, uint32_t cluster,
+                                   uint8_t sector) {
+    if (file->buffer && file->buffer_sector == SECTOR(cluster, sector))
+        return file->buffer;
+#ifdef FAT32_READ_AHEAD
+    uint32_t abs = SECTOR(cluster, sector);
+    for (uint8_t i = 0; i < _ra_count; ++i) {
+        if (_ra_sector[i] == abs) {
+            if (_ra_owner == file && i >= _ra_seen)
+                _ra_seen = i + 1;
+            return _ra_buf[i];
+        }
+    }
+    if (file->ra_window) {
+        _ra_fill(file, cluster, sector);
+        if (_ra_count) {
+            _ra_seen = 1;
+            return _ra_buf[0];
+        }
+    }
+#endif
+    /* Small reads and records keep landing in the same sector. */
+    if (_data_held != SECTOR(cluster, sector)
+        && _read_sector(SECTOR(cluster, sector), sdcard_sector))
+        _data_held = SECTOR(cluster, sector);
+    return sdcard_sector;
+}
+
+uint16_t fat32_read_file(Fat32File *file, char *buf, uint16_t len) {
+    _shared_in(file);
+    if (len > (file->file_size - file->cursor)) {
+        len = (file->file_size - file->cursor);
+    }
+#ifdef FAT32_READ_AHEAD
+    _ra_follow(file);
+#endif
+
+    uint16_t done = 0;
+    while (done < len) {
+        uint32_t cluster = _cluster_at(file, file->cursor);
+        if (!IS_VALID_CLUSTER(cluster))
+            break;
+        uint8_t sector = (file->cursor - file->cluster_pos) / SD_SECTOR_SIZE;
+        uint16_t offset = file->cursor % SD_SECTOR_SIZE;
+        const uint8_t *data = _data_sector(file, cluster, sector);
+        uint16_t n = SD_SECTOR_SIZE - offset;
+        if (n > len - done)
+            n = len - done;
+        memcpy(buf + done, data + offset, n);
+        done += n;
+        file->cursor += n;
+    }
+#ifdef FAT32_READ_AHEAD
+    file->ra_expect = file->cursor;
+#endif
+    _shared_out(file);
+    return done;
+}
+
+/**
+ * @return the first @param c in the @param len bytes at @param data, NULL
+ * if there is none. */
+static const uint8_t *_find_byte(const uint8_t *data, uint16_t len,
+                                 uint8_t c) {
+#ifdef FAT32_SWAR
+    /* Four bytes per step: a byte of word ^ pattern is zero where c is. */
+    const uint32_t ones = 0x01010101;
+    const uint32_t pattern = ones * c;
+    while (len && ((uintptr_t) data & 3)) {
+        if (*data == c)
+            return data;
+        data++;
+        len--;
+    }
+    for (; len >= 4; data += 4, len -= 4) {
+        uint32_t word;
+        memcpy(&word, data, 4);
+        word ^= pattern;
+        if ((word - ones) & ~word & (ones << 7))
+            break;
+    }
+    for (; len; data++, len--)
+        if (*data == c)
+            return data;
+    return NULL;
+#else
+    return (const uint8_t *) memchr(data, c, len);
+#endif
+}
+
+bool fat32_read_record(Fat32File *file, char delim, const char **record,
+                       uint16_t *len, bool *cut, char *spill,
+                       uint16_t spill_size) {
+    *len = 0;
+    *cut = false;
+    if (!spill_size)
+        return false;
+    _shared_in(file);
+#ifdef FAT32_READ_AHEAD
+    _ra_follow(file);
+#endif
+    uint16_t have = 0;
+    bool found = false;
+    *record = spill;
+    while (file->cursor < file->file_size) {
+        uint32_t cluster = _cluster_at(file, file->cursor);
+        if (!IS_VALID_CLUSTER(cluster))
+            break;
+        uint8_t sector = (file->cursor - file->cluster_pos) / SD_SECTOR_SIZE;
+        uint16_t offset = file->cursor % SD_SECTOR_SIZE;
+        const uint8_t *data = _data_sector(file, cluster, sector) + offset;
+        uint16_t n = SD_SECTOR_SIZE - offset;
+        if (n > file->file_size - file->cursor)
+            n = file->file_size - file->cursor;
+        const uint8_t *end = _find_byte(data, n, delim);
+        if (end && !have) {
+            /* All of it in one sector, no copy. */
+            *record = (const char *) data;
+            have = end - data;
+            file->cursor += have + 1;
+            found = true;
+            break;
+        }
+        uint16_t take = end ? end - data : n;
+        if (take > spill_size - have)
+            take = spill_size - have;
+        memcpy(spill + have, data, take);
+        have += take;
+        file->cursor += take;
+        if (end && data + take == end) {
+            file->cursor++;
+            found = true;
+            break;
+        }
+        if (have == spill_size) {
+            /* The rest comes with the next call. */
+            *cut = true;
+            break;
+        }
+    }
+#ifdef FAT32_READ_AHEAD
+    file->ra_expect = file->cursor;
+#endif
+    _shared_out(file);
+    *len = have;
+    return found || have;
+}
+
+/* Finds the cluster behind stream->cluster.  Uses sdcard_sector. */
+static bool _stream_next(Fat32Stream *stream) {
+    if (stream->run) {
+        stream->next = stream->cluster + 1;
+        return true;
+    }
+    uint32_t next;
+    uint32_t run = _chain_run(stream->cluster, &next);
+    if (!run)
+        return false;
+    stream->run = run - 1;
+    stream->next = run > 1 ? stream->cluster + 1 : next;
+    if (IS_VALID_CLUSTER(stream->next))
+        return true;
+    stream->next = 0;
+    return false;
+}
+
+Fat32Error fat32_stream_open(Fat32Stream *stream, Fat32File *file,
+                             uint8_t *buffers) {
+    _shared_in(file);
+    if (!file->exists)
+        return FAT32_INVALID_FILE;
+    stream->file = file;
+    stream->buffer[0] = buffers;
+    stream->buffer[1] = buffers + SD_SECTOR_SIZE;
+    stream->size[0] = 0;
+    stream->size[1] = 0;
+    stream->fill = 0;
+    stream->play = 0;
+    stream->pos = file->cursor % SD_SECTOR_SIZE;
+    stream->fill_pos = file->cursor - stream->pos;
+    stream->ended = stream->fill_pos >= file->file_size;
+    stream->next = 0;
+    stream->run = 0;
+    if (!stream->ended) {
+        stream->cluster = _cluster_at(file, stream->fill_pos);
+        if (!IS_VALID_CLUSTER(stream->cluster))
+            return FAT32_FS_ERROR;
+        stream->run = file->run;
+    }
+    _shared_out(file);
+    fat32_stream_refill(stream);
+    fat32_stream_refill(stream);
+    stream->worst_us = 0;
+    stream->misses = 0;
+    return FAT32_OK;
+}
+
+bool fat32_stream_refill(Fat32Stream *stream) {
+    uint32_t cluster_size = SD_SECTOR_SIZE * fat32_sectors_per_cluster;
+    uint32_t start = SD_MICROS();
+    bool ok = true;
+    if (stream->ended) {
+        return true;
+    } else if (stream->size[stream->fill]) {
+        /* Nothing to fill, look ahead while there is time, unless the
+         * file ends in this cluster. */
+        uint32_t offset = stream->fill_pos % cluster_size;
+        if (!stream->next && stream->file->file_size - stream->fill_pos
+            > cluster_size - offset)
+            ok = _stream_next(stream);
+    } else {
+        uint32_t offset = stream->fill_pos % cluster_size;
+        uint32_t left = stream->file->file_size - stream->fill_pos;
+        bool last = left <= SD_SECTOR_SIZE;
+        bool hop = !last && offset + SD_SECTOR_SIZE == cluster_size;
+        /* Without a look ahead in time the hop costs a FAT read now,
+         * worst_us shows it.  It comes first so a failure leaves the
+         * stream as it was for the next call. */
+        if (hop && !stream->next)
+            ok = _stream_next(stream);
+        if (ok)
+            ok = _read_sector(SECTOR(stream->cluster,
+                                     offset / SD_SECTOR_SIZE),
+                              stream->buffer[stream->fill]);
+        if (ok) {
+            stream->fill_pos += SD_SECTOR_SIZE;
+            if (hop) {
+                if (stream->run)
+                    stream->run--;
+                stream->cluster = stream->next;
+                stream->next = 0;
             }
-            _read_sector(SECTOR(cluster, sector), sdcard_sector);
+            /* The reading side takes it from here. */
+            stream->size[stream->fill] = left < SD_SECTOR_SIZE
+                ? left : SD_SECTOR_SIZE;
+            stream->fill ^= 1;
+            stream->ended = last;
         }
-        sdcard_sector[offset + (i % SD_SECTOR_SIZE)] = buf[i];
-        file->cursor++;
     }
-    sdcard_write_sector(SECTOR(cluster, sector), sdcard_sector);
-    /* Update size */
+    uint32_t took = SD_MICROS() - start;
+    if (took > stream->worst_us)
+        stream->worst_us = took;
+    return ok;
+}
+
+uint16_t fat32_stream_read(Fat32Stream *stream, char *buf, uint16_t len) {
+    uint16_t done = 0;
+    while (done < len) {
+        uint16_t size = stream->size[stream->play];
+        if (!size) {
+            if (!stream->ended)
+                stream->misses++;
+            break;
+        }
+        uint16_t n = size - stream->pos;
+        if (n > len - done)
+            n = len - done;
+        memcpy(buf + done, stream->buffer[stream->play] + stream->pos, n);
+        done += n;
+        stream->pos += n;
+        if (stream->pos >= size) {
+            stream->pos = 0;
+            stream->size[stream->play] = 0;
+            stream->play ^= 1;
+        }
+    }
+    return done;
+}
+
+/**
+ * Like _cluster_at() for the cursor of @param file, but grows the chain
+ * when the cursor sits right behind its end.
+ * @return 0 if the volume is full. */
+static uint32_t _cluster_for_write(Fat32File *file) {
+    uint32_t cluster_size = SD_SECTOR_SIZE * fat32_sectors_per_cluster;
+    _defrag_forget(file);
+    uint32_t cluster = _cluster_at(file, file->cursor);
+    if (IS_VALID_CLUSTER(cluster))
+        return cluster;
+    /* No holes, the cursor has to sit right behind the last cluster. */
+    if (file->cursor - file->cluster_pos != cluster_size)
+        return 0;
+    cluster = _claim_after(file->cluster, true);
+    if (cluster) {
+        file->cluster = cluster;
+        file->cluster_pos += cluster_size;
+    }
+    return cluster;
+}
+
+/* Writes size and starting cluster of @param file to its directory entry. */
+static void _update_entry(Fat32File *file) {
     _read_sector(file->entry_sector, sdcard_sector);
     Fat32Entry *fs_entry = (Fat32Entry *) sdcard_sector;
     fs_entry += file->entry_offset;
-    fs_entry->file_size = file->file_size += len;
-    sdcard_write_sector(file->entry_sector, sdcard_sector);
+    fs_entry->file_size = file->file_size;
+    fs_entry->starting_cluster = file->starting_cluster;
+    fs_entry->starting_cluster_high = file->starting_cluster >> 16;
+    _write_sector(file->entry_sector, sdcard_sector);
+    file->entry_dirty = false;
+}
+
+/**
+ * Collects writes to the sector under the cursor in file->buffer.  The
+ * sector is read only if it holds file data the write does not cover,
+ * and written once the cursor leaves it or fat32_flush() is called. */
+static Fat32Error _buffered_write(Fat32File *file, const char *buf,
+                                  uint16_t len) {
+    while (len) {
+        uint32_t cluster = _cluster_for_write(file);
+        if (!cluster)
+            return FAT32_FS_ERROR;
+        uint32_t sector = SECTOR(cluster, (file->cursor - file->cluster_pos)
+                                 / SD_SECTOR_SIZE);
+        uint16_t offset = file->cursor % SD_SECTOR_SIZE;
+        uint16_t n = SD_SECTOR_SIZE - offset;
+        if (n > len)
+            n = len;
+        if (file->buffer_sector != sector) {
+            if (file->buffer_dirty)
+                _write_sector(file->buffer_sector, file->buffer);
+            file->buffer_dirty = false;
+            uint32_t start = file->cursor - offset;
+            uint32_t end = file->file_size < start + SD_SECTOR_SIZE
+                ? file->file_size : start + SD_SECTOR_SIZE;
+            if (start < end && (offset || file->cursor + n < end))
+                _read_sector(sector, file->buffer);
+            else
+                memset(file->buffer, 0, SD_SECTOR_SIZE);
+            file->buffer_sector = sector;
+        }
+        memcpy(file->buffer + offset, buf, n);
+        if (!file->buffer_dirty && !file->entry_dirty)
+            file->buffer_since = SD_MICROS();
+        file->buffer_dirty = true;
+        buf += n;
+        len -= n;
+        file->cursor += n;
+        if (file->cursor > file->file_size) {
+            file->file_size = file->cursor;
+            file->entry_dirty = true;
+        }
+        if (offset + n == SD_SECTOR_SIZE) {
+            _write_sector(sector, file->buffer);
+            file->buffer_dirty = false;
+        }
+    }
+    return FAT32_OK;
+}
+
+Fat32Error fat32_write_file(Fat32File *file, const char *buf, uint16_t len) {
+    _shared_in(file);
+    if (!file->exists)
+        return FAT32_INVALID_FILE;
+    /* Files created elsewhere may come without a cluster. */
+    if (!IS_VALID_CLUSTER(file->starting_cluster)) {
+        file->starting_cluster = _claim(true);
+        if (!file->starting_cluster)
+            return FAT32_FS_ERROR;
+        file->cluster = 0;
+        file->entry_dirty = true;
+    }
+
+    if (file->buffer) {
+        Fat32Error err = _buffered_write(file, buf, len);
+        _shared_out(file);
+        return err;
+    }
+
+    uint16_t done = 0;
+    while (done < len) {
+        uint32_t cluster = _cluster_for_write(file);
+        if (!cluster) {
+            _shared_out(file);
+            return FAT32_FS_ERROR;
+        }
+        uint8_t sector = (file->cursor - file->cluster_pos) / SD_SECTOR_SIZE;
+        uint16_t offset = file->cursor % SD_SECTOR_SIZE;
+        uint16_t n = SD_SECTOR_SIZE - offset;
+        if (n > len - done)
+            n = len - done;
+        /* Only partial sectors need their old contents. */
+        if (n < SD_SECTOR_SIZE)
+            _read_sector(SECTOR(cluster, sector), sdcard_sector);
+        memcpy(sdcard_sector + offset, buf + done, n);
+        _write_sector(SECTOR(cluster, sector), sdcard_sector);
+        done += n;
+        file->cursor += n;
+    }
+    if (file->cursor > file->file_size)
+        file->file_size = file->cursor;
+    _update_entry(file);
+    _shared_out(file);
     return FAT32_OK;
 }
 
+Fat32Error fat32_buffer_writes(Fat32File *file, uint8_t *buffer) {
+    Fat32Error err = fat32_flush(file);
+    file->buffer = buffer;
+    file->buffer_sector = 0;
+    return err;
+}
+
+Fat32Error fat32_append_mode(Fat32File *file, uint8_t *buffer) {
+    Fat32Error err = fat32_buffer_writes(file, buffer);
+    _shared_in(file);
+    file->cursor = file->file_size;
+    return err;
+}
+
+Fat32Error fat32_flush(Fat32File *file) {
+    _shared_in(file);
+    if (file->buffer && file->buffer_dirty) {
+        _write_sector(file->buffer_sector, file->buffer);
+        file->buffer_dirty = false;
+    }
+    if (file->entry_dirty)
+        _update_entry(file);
+    return FAT32_OK;
+}
+
+Fat32Error fat32_flush_after(Fat32File *file, uint32_t max_age_us) {
+    if (!file->buffer_dirty && !file->entry_dirty)
+        return FAT32_OK;
+    if ((uint32_t) (SD_MICROS() - file->buffer_since) < max_age_us)
+        return FAT32_OK;
+    return fat32_flush(file);
+}
+
 Fat32Error fat32_delete_file(Fat32File *file) {
-    uint32_t cluster = file->starting_cluster;
-    uint32_t next_cluster;
-    do {
-        uint32_t sector = fat32_fat_start + cluster / (SD_SECTOR_SIZE / 4);
-        uint8_t offset = cluster % (SD_SECTOR_SIZE / 4);
-        _read_sector(sector, sdcard_sector);
-        uint32_t (*fat)[SD_SECTOR_SIZE / 4] = (uint32_t (*)[SD_SECTOR_SIZE / 4])
-            sdcard_sector;
-        next_cluster = (*fat)[offset];
-        (*fat)[offset] = 0;       /* mark free */
-        sdcard_write_sector(sector, sdcard_sector);
-        cluster = next_cluster;
-    } while (IS_VALID_CLUSTER(next_cluster));
+    _shared_in(file);
+    if (!file->exists)
+        return FAT32_INVALID_FILE;
+#ifdef FAT32_OPEN_FILES
+    _shared_siblings(file, true);
+#endif
+    _snapshot_stale();
+    file->buffer = NULL;
+    file->entry_dirty = false;
+    _defrag_forget(file);
+    _free_chain(file->starting_cluster, false);
     _read_sector(file->entry_sector, sdcard_sector);
     Fat32Entry *fs_entry = (Fat32Entry *) sdcard_sector;
     fs_entry += file->entry_offset;
     fs_entry->filename[0] = '\xe5'; /* mark as unused */
-    sdcard_write_sector(file->entry_sector, sdcard_sector);
+    uint8_t offset = file->entry_offset;
+    if (offset < SD_SECTOR_SIZE / sizeof (Fat32Entry) - 1
+        && !fs_entry[1].filename[0]) {
+        /* It was the last entry, move the end of the directory back over
+         * it and the unused ones in front so lookups stop earlier. */
+        while (offset && fs_entry[-1].filename[0] == '\xe5') {
+            fs_entry--;
+            offset--;
+        }
+        memset(fs_entry, 0, (file->entry_offset - offset + 1)
+               * sizeof (Fat32Entry));
+        /* A slot behind the end must not be handed out, one in front of
+         * it still can. */
+        if (_dir_free_sector && (_dir_free_sector > file->entry_sector
+            || (_dir_free_sector == file->entry_sector
+                && _dir_free_offset > offset))) {
+            _dir_free_sector = file->entry_sector;
+            _dir_free_offset = offset;
+        }
+    } else if (_dir_free_sector && (file->entry_sector < _dir_free_sector
+               || (file->entry_sector == _dir_free_sector
+                   && offset < _dir_free_offset))) {
+        _dir_free_sector = file->entry_sector;
+        _dir_free_offset = offset;
+    }
+    _write_sector(file->entry_sector, sdcard_sector);
     file->exists = false;
+    _shared_out(file);
+#ifdef FAT32_DISCARD
+    /* The clusters are only erased once nothing points at them. */
+    if (!_discard_defer)
+        return fat32_discard();
+#endif
+    return FAT32_OK;
+}
+
+Fat32Error fat32_delete_files(const char *pattern, Fat32Filter match,
+                              void *ctx) {
+    uint32_t heads[FAT32_BULK_CHAINS];
+    uint8_t count = 0;
+    Fat32File file;
+    bool dirty = false;
+    uint8_t sector = 0;
+    uint32_t cluster = fat32_root_cluster;
+    _snapshot_stale();
+    if (!_read_sector(SECTOR(cluster, sector), sdcard_sector))
+        return FAT32_GENERIC_SD_ERROR;
+    Fat32Entry *fs_entry = (Fat32Entry *) sdcard_sector;
+    while (fs_entry->filename[0]) {
+        if (fs_entry->filename[0] != '\xe5'
+            && !IS_NAME_EXT(fs_entry->attributes)
+            && !fs_entry->attributes.directory
+            && !fs_entry->attributes.volume_id) {
+            memset(file.name, 0, sizeof (file.name));
+            _copy_name(file.name, fs_entry->filename);
+            _entry_handle(&file, fs_entry, SECTOR(cluster, sector));
+            if ((!pattern || _match_name(pattern, file.name))
+                && (!match || match(&file, ctx))) {
+                if (count + 2 > FAT32_BULK_CHAINS) {
+                    /* Entries first, a crash in between only loses the
+                     * clusters. */
+                    if (dirty)
+                        _write_sector(file.entry_sector, sdcard_sector);
+                    dirty = false;
+                    _free_chains(heads, count);
+                    count = 0;
+                    _read_sector(file.entry_sector, sdcard_sector);
+                }
+                fs_entry->filename[0] = '\xe5'; /* mark as unused */
+                dirty = true;
+                heads[count++] = file.starting_cluster;
+                if (_defrag_cand && file.starting_cluster == _defrag_cand)
+                    _defrag_cand = 0;
+                if (_defrag_from && file.starting_cluster == _defrag_from) {
+                    heads[count++] = _defrag_to;
+                    _defrag_from = 0;
+                }
+#ifdef FAT32_OPEN_FILES
+                _shared_entry_gone(file.entry_sector, file.entry_offset);
+#endif
+                if (_dir_free_sector
+                    && (file.entry_sector < _dir_free_sector
+                        || (file.entry_sector == _dir_free_sector
+                            && file.entry_offset < _dir_free_offset))) {
+                    _dir_free_sector = file.entry_sector;
+                    _dir_free_offset = file.entry_offset;
+                }
+            }
+        }
+
+        fs_entry++;
+
+        if ((uint8_t *) fs_entry >= (sdcard_sector + SD_SECTOR_SIZE)) {
+            if (dirty)
+                _write_sector(SECTOR(cluster, sector), sdcard_sector);
+            dirty = false;
+            if (++sector == fat32_sectors_per_cluster) {
+                sector = 0;
+                cluster = fat32_get_next_cluster(cluster);
+                if (!IS_VALID_CLUSTER(cluster))
+                    break;
+            }
+            _read_sector(SECTOR(cluster, sector), sdcard_sector);
+            fs_entry = (Fat32Entry *) sdcard_sector;
+        }
+    }
+    if (dirty)
+        _write_sector(SECTOR(cluster, sector), sdcard_sector);
+    _free_chains(heads, count);
+#ifdef FAT32_DISCARD
+    if (!_discard_defer)
+        return fat32_discard();
+#endif
+    return FAT32_OK;
+}
+
+Fat32Error fat32_truncate(Fat32File *file, uint32_t new_size) {
+    uint32_t cluster_size = SD_SECTOR_SIZE * fat32_sectors_per_cluster;
+    _shared_in(file);
+    if (new_size >= file->file_size)
+        return FAT32_OK;
+#ifdef FAT32_OPEN_FILES
+    _shared_siblings(file, false);
+#endif
+    _defrag_forget(file);
+    /* What is held back still goes out, the buffer then starts over. */
+    if (file->buffer && file->buffer_dirty)
+        _write_sector(file->buffer_sector, file->buffer);
+    file->buffer_dirty = false;
+    file->buffer_sector = 0;
+    if (IS_VALID_CLUSTER(file->starting_cluster)) {
+        uint32_t (*fat)[SD_SECTOR_SIZE / 4] = (uint32_t (*)[SD_SECTOR_SIZE / 4])
+            sdcard_sector;
+        /* The cluster holding the last byte kept, the first one at least. */
+        uint32_t last = new_size ? (new_size - 1) / cluster_size : 0;
+        uint32_t cluster = file->starting_cluster;
+        uint32_t n = 0;
+        uint32_t sector = 0;
+        if (IS_VALID_CLUSTER(file->cluster)
+            && file->cluster_pos <= last * cluster_size) {
+            cluster = file->cluster;
+            n = file->cluster_pos / cluster_size;
+        }
+        /* Walk there with one read per FAT sector. */
+        for (; n < last; ++n) {
+            if (FAT_SECTOR(cluster) != sector) {
+                sector = FAT_SECTOR(cluster);
+                if (!_read_sector(sector, sdcard_sector))
+                    return FAT32_GENERIC_SD_ERROR;
+            }
+            cluster = (*fat)[cluster % (SD_SECTOR_SIZE / 4)] & 0x0fffffff;
+            if (!IS_VALID_CLUSTER(cluster))
+                return FAT32_FS_ERROR;
+        }
+        file->cluster = cluster;
+        file->cluster_pos = last * cluster_size;
+        file->run = 0;
+#ifdef FAT32_READ_AHEAD
+        file->ra_next = 0;
+#endif
+        _free_chain(cluster, true);
+    }
+    file->file_size = new_size;
+    if (file->cursor > new_size)
+        file->cursor = new_size;
+    _update_entry(file);
+    _shared_out(file);
+#ifdef FAT32_DISCARD
+    if (!_discard_defer)
+        return fat32_discard();
+#endif
+    return FAT32_OK;
+}
+
+Fat32Error fat32_copy_file(Fat32File *src, const char *dst_name,
+                           Fat32File *dst) {
+    uint32_t cluster_size = SD_SECTOR_SIZE * fat32_sectors_per_cluster;
+    _shared_in(src);
+    uint32_t clusters = (src->file_size + cluster_size - 1) / cluster_size;
+    Fat32Error err = fat32_flush(src);
+    if (err != FAT32_OK)
+        return err;
+    err = fat32_create_file(dst, dst_name);
+    if (err != FAT32_OK)
+        return err;
+    if (clusters > 1 && !_extend_chain(dst->starting_cluster, clusters - 1)) {
+        fat32_delete_file(dst);
+        return FAT32_FS_ERROR;
+    }
+
+    /* Both chains are taken a contiguous run at a time, sectors go across
+     * in as large pieces as both runs and the buffer allow. */
+    uint32_t left = (src->file_size + SD_SECTOR_SIZE - 1) / SD_SECTOR_SIZE;
+    uint32_t src_next = src->starting_cluster;
+    uint32_t dst_next = dst->starting_cluster;
+    uint32_t src_sector = 0, src_run = 0;
+    uint32_t dst_sector = 0, dst_run = 0;
+    while (left) {
+        if (!src_run && IS_VALID_CLUSTER(src_next)) {
+            src_sector = SECTOR(src_next, 0);
+            src_run = _chain_run(src_next, &src_next)
+                * fat32_sectors_per_cluster;
+        }
+        if (!dst_run && IS_VALID_CLUSTER(dst_next)) {
+            dst_sector = SECTOR(dst_next, 0);
+            dst_run = _chain_run(dst_next, &dst_next)
+                * fat32_sectors_per_cluster;
+        }
+        if (!src_run || !dst_run) {
+            err = FAT32_FS_ERROR;
+            break;
+        }
+        uint32_t n = left;
+        if (n > src_run)
+            n = src_run;
+        if (n > dst_run)
+            n = dst_run;
+        if (!_copy_sectors(src_sector, dst_sector, n)) {
+            err = FAT32_GENERIC_SD_ERROR;
+            break;
+        }
+        src_sector += n;
+        src_run -= n;
+        dst_sector += n;
+        dst_run -= n;
+        left -= n;
+    }
+    if (err != FAT32_OK) {
+        fat32_delete_file(dst);
+        return err;
+    }
+    dst->file_size = src->file_size;
+    _update_entry(dst);
     return FAT32_OK;
 }
 
+/* The copy is complete, switch the directory entry over to it. */
+static void _defrag_commit(void) {
+    uint32_t from = _defrag_from;
+    _defrag_from = 0;
+    _read_sector(_defrag_entry_sector, sdcard_sector);
+    Fat32Entry *fs_entry = (Fat32Entry *) sdcard_sector;
+    fs_entry += _defrag_entry_offset;
+    if (fs_entry->filename[0] == '\xe5' || ENTRY_CLUSTER(fs_entry) != from
+        || fs_entry->file_size != _defrag_size) {
+        /* Changed behind our back. */
+        _free_chain(_defrag_to, false);
+        return;
+    }
+    /* Clusters appended behind the size on the card (by a handle that has
+     * not updated the entry yet) would be freed with the old chain. */
+    uint32_t last = (_defrag_src_sector - 1 - fat32_data_start)
+        / fat32_sectors_per_cluster + 2;
+    uint32_t next = fat32_get_next_cluster(last);
+    if (next < 0x0ffffff8 || next > 0x0fffffff) {
+        _free_chain(_defrag_to, false);
+        return;
+    }
+#ifdef FAT32_OPEN_FILES
+    if (_shared_dirty(from)) {
+        /* A held back sector would land in the old chain. */
+        _free_chain(_defrag_to, false);
+        return;
+    }
+#endif
+    _read_sector(_defrag_entry_sector, sdcard_sector);
+    fs_entry = (Fat32Entry *) sdcard_sector + _defrag_entry_offset;
+    fs_entry->starting_cluster = _defrag_to;
+    fs_entry->starting_cluster_high = _defrag_to >> 16;
+    /* A single sector write moves the file, before it the old chain is
+     * intact and the new one merely lost, after it the other way round. */
+    _write_sector(_defrag_entry_sector, sdcard_sector);
+    _free_chain(from, false);
+    _defrag_moved = true;
+#ifdef FAT32_OPEN_FILES
+    _shared_moved(from, _defrag_to);
+#endif
+#ifdef FAT32_DISCARD
+    if (!_discard_defer)
+        fat32_discard();
+#endif
+}
+
+/**
+ * Ends a pass of fat32_defrag().
+ * @return true if it found nothing to move. */
+static bool _defrag_pass_end(void) {
+    bool done = !_defrag_moved;
+    _defrag_dir = 0;
+    _defrag_moved = false;
+    return done;
+}
+
+bool fat32_defrag(uint16_t max_sectors) {
+    const uint8_t per_sector = SD_SECTOR_SIZE / sizeof (Fat32Entry);
+    const uint16_t per_cluster = per_sector * fat32_sectors_per_cluster;
+    uint32_t cluster_size = SD_SECTOR_SIZE * fat32_sectors_per_cluster;
+    int32_t budget = max_sectors;
+    while (budget > 0) {
+        if (_defrag_from) {
+            uint32_t left = (_defrag_size + SD_SECTOR_SIZE - 1)
+                / SD_SECTOR_SIZE - _defrag_done;
+            if (!left) {
+                _defrag_commit();
+                budget -= 3;
+                continue;
+            }
+            if (!_defrag_src_left) {
+                if (IS_VALID_CLUSTER(_defrag_src)) {
+                    _defrag_src_sector = SECTOR(_defrag_src, 0);
+                    _defrag_src_left = _chain_run(_defrag_src, &_defrag_src)
+                        * fat32_sectors_per_cluster;
+                    budget--;
+                }
+                if (!_defrag_src_left) {
+                    /* The chain is shorter than the size says, leave it. */
+                    _defrag_from = 0;
+                    _free_chain(_defrag_to, false);
+                    continue;
+                }
+            }
+            uint32_t n = left;
+            if (n > _defrag_src_left)
+                n = _defrag_src_left;
+            if (n > (uint32_t) budget)
+                n = budget;
+            if (!_copy_sectors(_defrag_src_sector,
+                               SECTOR(_defrag_to, 0) + _defrag_done, n))
+                return false;
+            _defrag_src_sector += n;
+            _defrag_src_left -= n;
+            _defrag_done += n;
+            budget -= n;
+            continue;
+        }
+
+        uint32_t clusters = (_defrag_size + cluster_size - 1) / cluster_size;
+        if (_defrag_cand && _defrag_check_left) {
+            /* Is it fragmented at all?  One FAT sector per step. */
+            uint32_t next;
+            uint32_t run = _chain_run(_defrag_check, &next);
+            budget--;
+            if (!run || run >= _defrag_check_left) {
+                _defrag_cand = 0;
+            } else if (next != _defrag_check + run) {
+                _defrag_check_left = 0;
+                _defrag_scan = 0;
+                _defrag_run = 0;
+            } else {
+                _defrag_check = next;
+                _defrag_check_left -= run;
+            }
+            continue;
+        }
+        if (_defrag_cand) {
+            /* Look for a free run to move it to, one FAT sector per step. */
+            uint32_t to = _find_free_run(clusters);
+            budget--;
+            if (!to) {
+                if (_defrag_scan >= fat32_cluster_count + 2)
+                    _defrag_cand = 0;
+                continue;
+            }
+            uint32_t from = _defrag_cand;
+            _defrag_cand = 0;
+            /* What an earlier call found free may be taken by now. */
+            budget -= clusters / (SD_SECTOR_SIZE / 4) + 1;
+            if (!_range_free(to, clusters)) {
+                _defrag_moved = true;
+                continue;
+            }
+            /* Claimed before the copy, nothing else may land there. */
+            _claim_run(to, clusters);
+            _defrag_from = from;
+            _defrag_to = to;
+            _defrag_done = 0;
+            _defrag_src = from;
+            _defrag_src_left = 0;
+            continue;
+        }
+
+        /* Next entry of the root directory, where the last call left off. */
+        if (!_defrag_dir) {
+            _defrag_dir = fat32_root_cluster;
+            _defrag_index = 0;
+        }
+        if (_defrag_index == per_cluster) {
+            uint32_t next = fat32_get_next_cluster(_defrag_dir);
+            budget--;
+            if (!IS_VALID_CLUSTER(next))
+                return _defrag_pass_end();
+            _defrag_dir = next;
+            _defrag_index = 0;
+        }
+        uint32_t sector = SECTOR(_defrag_dir, _defrag_index / per_sector);
+        if (!_read_sector(sector, sdcard_sector))
+            return false;
+        budget--;
+        Fat32Entry *fs_entry = (Fat32Entry *) sdcard_sector
+            + _defrag_index % per_sector;
+        do {
+            if (!fs_entry->filename[0])
+                return _defrag_pass_end();
+            _defrag_index++;
+            clusters = (fs_entry->file_size + cluster_size - 1)
+                / cluster_size;
+            if (fs_entry->filename[0] != '\xe5'
+                && !IS_NAME_EXT(fs_entry->attributes)
+                && !fs_entry->attributes.directory
+                && !fs_entry->attributes.volume_id && clusters >= 2
+                && IS_VALID_CLUSTER(ENTRY_CLUSTER(fs_entry))) {
+                _defrag_cand = ENTRY_CLUSTER(fs_entry);
+                _defrag_size = fs_entry->file_size;
+                _defrag_entry_sector = sector;
+                _defrag_entry_offset =
+                    ((uint8_t *) fs_entry - sdcard_sector) / sizeof (Fat32Entry);
+                _defrag_check = _defrag_cand;
+                _defrag_check_left = clusters;
+                break;
+            }
+            fs_entry++;
+        } while (_defrag_index % per_sector);
+    }
+    return false;
+}
+
 Fat32Error fat32_create_file(Fat32File *file, const char *name) {
     uint8_t sector = 0;
     uint32_t cluster = fat32_root_cluster;
+    uint8_t offset = 0;
+    if (_dir_free_sector) {
+        /* Everything in front of the hint is taken, start there. */
+        cluster = (_dir_free_sector - fat32_data_start)
+            / fat32_sectors_per_cluster + 2;
+        sector = (_dir_free_sector - fat32_data_start)
+            % fat32_sectors_per_cluster;
+        offset = _dir_free_offset;
+    }
     _read_sector(SECTOR(cluster, sector), sdcard_sector);
-    Fat32Entry *fs_entry = (Fat32Entry *) sdcard_sector;
+    Fat32Entry *fs_entry = (Fat32Entry *) sdcard_sector + offset;
     while (fs_entry->filename[0] != 0 &&
            fs_entry->filename[0] != '\xe5') {
         fs_entry++;
         /* Switch to next cluster/sector. */
         if ((uint8_t *) fs_entry >= (sdcard_sector + SD_SECTOR_SIZE)) {
-            if (sector++ == fat32_sectors_per_cluster) {
+            if (++sector == fat32_sectors_per_cluster) {
                 sector = 0;
-                cluster = fat32_get_next_cluster(cluster);
+                uint32_t next_cluster = fat32_get_next_cluster(cluster);
                 /* Allocate new cluster for root directory. */
-                if (!IS_VALID_CLUSTER(cluster)) {
-                    uint32_t next_cluster = fat32_claim_free_cluster();
-                    fat32_link_clusters(cluster, next_cluster);
-                    cluster = next_cluster;
+                if (!IS_VALID_CLUSTER(next_cluster)) {
+                    next_cluster = _claim_after(cluster, false);
+                    if (!next_cluster)
+                        return FAT32_FS_ERROR;
+                    _zero_cluster(next_cluster);
                 }
+                cluster = next_cluster;
             }
             _read_sector(SECTOR(cluster, sector), sdcard_sector);
             fs_entry = (Fat32Entry *) sdcard_sector;
         }
     }
 
-    uint32_t file_cluster = fat32_claim_free_cluster();
+    uint32_t file_cluster = _claim(true);
+    if (!file_cluster)
+        return FAT32_FS_ERROR;
     _read_sector(SECTOR(cluster, sector), sdcard_sector);
     Fat32EntryAttr attr;
     attr.bits = 0;
-    file->starting_cluster = fs_entry->starting_cluster = file_cluster;
+    file->starting_cluster = file_cluster;
+    fs_entry->starting_cluster = file_cluster;
+    fs_entry->starting_cluster_high = file_cluster >> 16;
     file->file_size = fs_entry->file_size = 0;
     fs_entry->modify_date = 0;
     fs_entry->modify_time = 0;
@@ -375,23 +2484,184 @@ Fat32Error fat32_create_file(Fat32File *file, const char *name) {
     if (!_rev_copy_name(fs_entry->filename, name)) {
         return FAT32_FILENAME_ERROR;
     }
-    sdcard_write_sector(SECTOR(cluster, sector), sdcard_sector);
+    _write_sector(SECTOR(cluster, sector), sdcard_sector);
     file->entry_sector = SECTOR(cluster, sector);
     file->entry_offset =
         ((uint8_t *)fs_entry - sdcard_sector) / sizeof (Fat32Entry);
+    _dir_free_sector = file->entry_sector;
+    _dir_free_offset = file->entry_offset;
     file->exists = true;
     file->cursor = 0;
+    _open_handle(file);
     return FAT32_OK;
 }
 
 Fat32Error fat32_rename_file(Fat32File *file, const char *new_name) {
+    _shared_in(file);
     _read_sector(file->entry_sector, sdcard_sector);
     Fat32Entry *fs_entry = (Fat32Entry *) sdcard_sector;
     fs_entry += file->entry_offset;
     if (!_rev_copy_name(fs_entry->filename, new_name))
         return FAT32_FILENAME_ERROR;
-    sdcard_write_sector(file->entry_sector, sdcard_sector);
+    _write_sector(file->entry_sector, sdcard_sector);
+    memset(file->name, 0, sizeof (file->name));
     memcpy(file->name, new_name, strlen(new_name));
+    _shared_out(file);
+    return FAT32_OK;
+}
+
+Fat32Error fat32_compact_dir(void) {
+    const uint8_t per_sector = SD_SECTOR_SIZE / sizeof (Fat32Entry);
+    const uint16_t per_cluster = per_sector * fat32_sectors_per_cluster;
+    uint32_t rd_cluster = fat32_root_cluster;
+    uint32_t wr_cluster = fat32_root_cluster;
+    uint16_t rd = 0;              /* Entries within the cluster. */
+    uint16_t wr = 0;
+    uint32_t loaded = 0;          /* Sector in sdcard_sector, 0 if none. */
+    bool dirty = false;
+    uint16_t gone = 0;            /* Entries of `loaded` moved elsewhere. */
+    Fat32Entry moved;
+    _snapshot_stale();
+    _defrag_restart();
+    for (;;) {
+        uint32_t sector = SECTOR(rd_cluster, rd / per_sector);
+        if (sector != loaded) {
+            if (dirty)
+                _write_sector(loaded, sdcard_sector);
+            dirty = false;
+            gone = 0;
+            if (!_read_sector(sector, sdcard_sector))
+                return FAT32_GENERIC_SD_ERROR;
+            loaded = sector;
+        }
+        Fat32Entry *fs_entry = (Fat32Entry *) sdcard_sector + rd % per_sector;
+        if (!fs_entry->filename[0])
+            break;
+        if (fs_entry->filename[0] != '\xe5') {
+            if (wr == per_cluster) {
+                if (dirty)
+                    _write_sector(loaded, sdcard_sector);
+                dirty = false;
+                loaded = 0;
+                wr_cluster = fat32_get_next_cluster(wr_cluster);
+                wr = 0;
+                continue;
+            }
+            uint32_t to = SECTOR(wr_cluster, wr / per_sector);
+            if (to == loaded && wr != rd) {
+                ((Fat32Entry *) sdcard_sector)[wr % per_sector] = *fs_entry;
+                fs_entry->filename[0] = '\xe5';
+                dirty = true;
+#ifdef FAT32_OPEN_FILES
+                _shared_entry_moved(sector, rd % per_sector, to,
+                                    wr % per_sector);
+#endif
+            } else if (to != loaded) {
+                /* The copy lands first, a crash in between leaves the
+                 * entry twice rather than not at all.  This sector only
+                 * lost entries so far, `gone` replays that after reading
+                 * it again and it is written once when done with. */
+                moved = *fs_entry;
+                _read_sector(to, sdcard_sector);
+                ((Fat32Entry *) sdcard_sector)[wr % per_sector] = moved;
+                _write_sector(to, sdcard_sector);
+                _read_sector(sector, sdcard_sector);
+                gone |= 1 << (rd % per_sector);
+                for (uint8_t i = 0; i < per_sector; ++i)
+                    if (gone & (1 << i))
+                        ((Fat32Entry *) sdcard_sector)[i].filename[0] = '\xe5';
+                dirty = true;
+#ifdef FAT32_OPEN_FILES
+                _shared_entry_moved(sector, rd % per_sector, to,
+                                    wr % per_sector);
+#endif
+            }
+            wr++;
+        }
+        if (++rd == per_cluster) {
+            if (dirty)
+                _write_sector(loaded, sdcard_sector);
+            dirty = false;
+            loaded = 0;
+            rd_cluster = fat32_get_next_cluster(rd_cluster);
+            rd = 0;
+            if (!IS_VALID_CLUSTER(rd_cluster))
+                break;
+        }
+    }
+    if (dirty)
+        _write_sector(loaded, sdcard_sector);
+
+    /* Everything from wr on is unused now, end the directory there. */
+    uint8_t last = fat32_sectors_per_cluster - 1;
+    if (rd_cluster == wr_cluster)
+        last = rd / per_sector;
+    for (uint8_t i = wr / per_sector; wr < per_cluster && i <= last; ++i) {
+        if (i == wr / per_sector && wr % per_sector) {
+            _read_sector(SECTOR(wr_cluster, i), sdcard_sector);
+            memset((Fat32Entry *) sdcard_sector + wr % per_sector, 0,
+                   (per_sector - wr % per_sector) * sizeof (Fat32Entry));
+        } else {
+            memset(sdcard_sector, 0, SD_SECTOR_SIZE);
+        }
+        _write_sector(SECTOR(wr_cluster, i), sdcard_sector);
+    }
+    _free_chain(wr_cluster, true);
+    if (wr == per_cluster)
+        wr--;                     /* Full, the next create grows it. */
+    _dir_free_sector = SECTOR(wr_cluster, wr / per_sector);
+    _dir_free_offset = wr % per_sector;
+#ifdef FAT32_DISCARD
+    if (!_discard_defer)
+        return fat32_discard();
+#endif
     return FAT32_OK;
 }
 
+#ifdef FAT32_OPEN_FILES
+Fat32File *fat32_open(const char *name, bool create) {
+    uint8_t slot = FAT32_OPEN_FILES;
+    for (uint8_t i = 0; i < FAT32_OPEN_FILES; ++i)
+        if (!_open_files[i].shared)
+            slot = i;
+    if (slot == FAT32_OPEN_FILES)
+        return NULL;
+    Fat32File *file = &_open_files[slot];
+    memset(file, 0, sizeof (*file));
+
+    /* Already open, the directory need not be looked at. */
+    uint8_t unused = 0;
+    for (uint8_t i = 0; i < FAT32_OPEN_FILES; ++i) {
+        if (!_shared[i].users) {
+            unused = i;
+        } else if (_shared[i].exists && strcmp(_shared[i].name, name) == 0) {
+            _shared[i].users++;
+            file->shared = i + 1;
+            _shared_in(file);
+            return file;
+        }
+    }
+
+    Fat32Error err = fat32_find_file(file, name);
+    if (err == FAT32_INVALID_FILE && create)
+        err = fat32_create_file(file, name);
+    if (err != FAT32_OK)
+        return NULL;
+    _shared[unused].users = 1;
+    _shared[unused].cluster = 0;
+    file->shared = unused + 1;
+    _shared_out(file);
+    return file;
+}
+
+Fat32Error fat32_close(Fat32File *file) {
+    if (!file->shared)
+        return FAT32_INVALID_FILE;
+    Fat32Error err = FAT32_OK;
+    if (file->exists)
+        err = fat32_flush(file);
+    _shared[file->shared - 1].users--;
+    file->shared = 0;
+    return err;
+}
+#endif
@@ -2,6 +2,7 @@
 #define FAT32_LIB
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #define READ_SECTOR_TRIES 5
 #define BOOT_SIGNATURE 0xaa55
@@ -11,6 +12,8 @@
 #define IS_FREE_CLUSTER(C) ((C) == 0x00000000)
 #define IS_NAME_EXT(A) ((A).read_only && (A).hidden && (A).system       \
                         && (A).volume_id)
+#define ENTRY_CLUSTER(E) ((E)->starting_cluster                       \
+                          | (uint32_t) (E)->starting_cluster_high << 16)
 #define SECTOR(C, S) (fat32_data_start +     \
                       (fat32_sectors_per_cluster * ((C) - 2)) + (S))
 
@@ -57,6 +60,42 @@ typedef struct {
     uint16_t boot_sector_signature;
 } __attribute__ ((packed)) Fat32BootSector;
 
+#define FSINFO_LEAD_SIGNATURE 0x41615252
+#define FSINFO_STRUCT_SIGNATURE 0x61417272
+#define FSINFO_TRAIL_SIGNATURE 0xaa550000
+#define FSINFO_UNKNOWN 0xffffffff
+
+#define FAT32_SNAPSHOT_MAGIC 0x4d524157 /* "WARM" */
+
+/* What fat32_mount() would otherwise have to find out again, kept at the
+ * end of FSInfo's reserved area (see FAT32_SNAPSHOT).  48 bytes. */
+typedef struct {
+    uint32_t magic;
+    uint32_t generation;      /* Fat32FsInfo.generation when taken. */
+    uint32_t free_count;      /* FSInfo fields it was taken with. */
+    uint32_t next_free;
+    uint32_t scan_pos;        /* fat32_scan_free() progress. */
+    uint32_t scan_free;
+    uint32_t dir_free_sector; /* Free directory slot hint, 0 if none. */
+    uint32_t au_clusters;     /* AU size the two below belong to. */
+    uint32_t au_next;
+    uint32_t au_fill;
+    uint8_t dir_free_offset;
+    uint8_t __reserved[3];
+    uint32_t checksum;        /* Over everything in front of it. */
+} __attribute__ ((packed)) Fat32Snapshot;
+
+typedef struct {
+    uint32_t lead_signature;
+    uint8_t __reserved1[480 - 4 - sizeof (Fat32Snapshot)];
+    uint32_t generation;      /* Bumped whenever a snapshot goes stale. */
+    Fat32Snapshot snapshot;
+    uint32_t struct_signature;
+    uint32_t free_count;          /* FSINFO_UNKNOWN if not known. */
+    uint32_t next_free;           /* Allocation hint, same. */
+    uint8_t __reserved2[12];
+    uint32_t trail_signature;
+} __attribute__ ((packed)) Fat32FsInfo;
 
 typedef union {
     uint8_t bits;
@@ -69,20 +108,59 @@ typedef union {
         unsigned archive : 1;
         unsigned __reserved1 : 1;
         unsigned __reserved2 : 1;
-    };
+    } __attribute__ ((packed));
 } __attribute__ ((packed)) Fat32EntryAttr;
 
 typedef struct {
     char filename[8];
     char ext[3];
     Fat32EntryAttr attributes;
-    uint8_t reserved[10];
+    uint8_t reserved[8];
+    uint16_t starting_cluster_high;
     uint16_t modify_time;
     uint16_t modify_date;
     uint16_t starting_cluster;
     uint32_t file_size;
 } __attribute__ ((packed)) Fat32Entry;
 
+/* Define FAT32_READ_AHEAD as the number of spare sector buffers to prefetch
+ * into while a handle is read front to back (needs sdcard_read_sectors()
+ * and sdcard_write_sectors()). */
+
+/* Define FAT32_SWAR to look for record delimiters four bytes at a time
+ * instead of with memchr(), for C libraries whose memchr() goes byte by
+ * byte (common on microcontrollers). */
+
+/* Define FAT32_DISCARD as the number of freed cluster runs to remember for
+ * erasing (needs sdcard_erase_sectors()). */
+
+/* Define FAT32_SNAPSHOT to save the free cluster scan, allocation and
+ * directory hints into FSInfo on fat32_update_fsinfo() and take them back
+ * on fat32_mount() while nothing changed in between. */
+
+/* Define FAT32_OPEN_FILES as the number of handles fat32_open() can hand
+ * out at the same time. */
+
+/* Chains fat32_delete_files() collects before freeing them together, 4
+ * bytes of stack each. */
+#ifndef FAT32_BULK_CHAINS
+#define FAT32_BULK_CHAINS 16
+#endif
+
+/* Define FAT32_TRACE to record every sector request into a ring buffer of
+ * FAT32_TRACE_SIZE records (needs SD_MICROS() from the port). */
+#ifndef FAT32_TRACE_SIZE
+#define FAT32_TRACE_SIZE 64
+#endif
+#define FAT32_TRACE_WRITE 0x8000
+
+/* 10 bytes per record.  A trace file is a plain array of these. */
+typedef struct {
+    uint32_t sector;
+    uint32_t time;    /* SD_MICROS() when the request was issued. */
+    uint16_t tag;     /* fat32.c line of the call site, | FAT32_TRACE_WRITE. */
+} __attribute__ ((packed)) Fat32TraceRecord;
+
 typedef enum {
     FAT32_OK = 0,
     FAT32_NO_SDCARD,
@@ -93,7 +171,10 @@ typedef enum {
     FAT32_FS_ERROR
 } Fat32Error;
 
-/* 32 bytes per File. */
+/* 56 bytes per File on AVR, 64 on 32 bit and 72 on 64 bit targets.
+ * FAT32_READ_AHEAD adds 9, 12 and 8 of them, FAT32_OPEN_FILES 1 on AVR
+ * and nothing where it fits into padding.  fat32_bench checks the 64 bit
+ * figures. */
 typedef struct {
     bool exists;
     char name[13]; /* name + extension + period + NUL */
@@ -103,8 +184,46 @@ typedef struct {
     uint32_t cursor;
     uint32_t entry_sector;
     uint8_t entry_offset;
+    uint32_t cluster;       /* Cluster holding byte cluster_pos, 0 if unknown. */
+    uint32_t cluster_pos;
+    uint32_t run;           /* Clusters known to follow `cluster` in a row. */
+    uint8_t *buffer;        /* Write buffer, NULL if writes go straight out. */
+    uint32_t buffer_sector; /* Sector held in buffer, 0 if none. */
+    uint32_t buffer_since;  /* SD_MICROS() of the oldest unwritten change. */
+    bool buffer_dirty;
+    bool entry_dirty;       /* Directory entry lags behind size/cluster. */
+#ifdef FAT32_READ_AHEAD
+    uint32_t ra_expect;     /* Cursor a sequential read would start at. */
+    uint32_t ra_next;       /* Cluster following `cluster`, 0 if unknown. */
+    uint8_t ra_window;      /* Sectors to prefetch, 0 if not sequential. */
+#endif
+#ifdef FAT32_OPEN_FILES
+    uint8_t shared;         /* 1 + its record in the open-file table. */
+#endif
 } Fat32File;
 
+/* A file played back through two sector buffers, see fat32_stream_open().
+ * The fields marked volatile are what the reading side shares with the
+ * refilling side. */
+typedef struct {
+    Fat32File *file;
+    uint8_t *buffer[2];         /* SD_SECTOR_SIZE bytes each. */
+    volatile uint16_t size[2];  /* Bytes in each, 0 while it waits for data. */
+    volatile bool ended;        /* Everything up to the end is buffered. */
+    uint8_t fill;               /* Buffer the next refill goes into. */
+    uint8_t play;               /* Buffer being read from. */
+    uint16_t pos;               /* Read position in it. */
+    uint32_t fill_pos;          /* File offset of the next sector to read. */
+    uint32_t cluster;           /* Cluster holding fill_pos. */
+    uint32_t next;              /* Cluster after it, 0 until looked up. */
+    uint32_t run;               /* Clusters known to follow in a row. */
+    uint32_t worst_us;          /* Longest fat32_stream_refill() so far. */
+    volatile uint32_t misses;   /* Reads that ran dry before the end. */
+} Fat32Stream;
+
+/* Decides about, or is shown, one file of the root directory. */
+typedef bool (*Fat32Filter)(const Fat32File *file, void *ctx);
+
 Fat32Error fat32_mount(void);
 
 Fat32Error fat32_get_nth_file(Fat32File *file, uint32_t n);
@@ -113,23 +232,213 @@ uint32_t fat32_get_next_cluster(uint32_t cluster);
 
 Fat32Error fat32_find_file(Fat32File *file, const char *filename);
 
+/**
+ * Hands every file of the root directory to @param visit in one pass, as
+ * an open handle with its name, attributes, size and first cluster.
+ * Where fat32_get_nth_file() starts over for every n this reads each
+ * directory sector once.  @param visit must not call into fat32.c (copy
+ * the handle to use it later) and returns false to stop.
+ * @return the number of files visited. */
+uint32_t fat32_list(Fat32Filter visit, void *ctx);
+
 uint16_t fat32_read_file(Fat32File *file, char *buf, uint16_t len);
 
+/**
+ * Reads the next record of @param file up to (and past) @param delim,
+ * e.g. a line of a log.  @param record is pointed right into the sector
+ * buffer when the record lies within one sector, only records crossing a
+ * sector end are put together in @param spill of @param spill_size bytes.
+ * Longer ones come in pieces of spill_size, @param cut is set on all but
+ * the last.  The record is good until the next call into fat32.c, @param
+ * len does not count the delimiter.
+ * @return false at the end of the file or if spill_size is 0. */
+bool fat32_read_record(Fat32File *file, char delim, const char **record,
+                       uint16_t *len, bool *cut, char *spill,
+                       uint16_t spill_size);
+
+/**
+ * Starts playing @param file back from its cursor through @param buffers
+ * (2 * SD_SECTOR_SIZE bytes): fat32_stream_read(), e.g. from a timer,
+ * takes from one buffer while fat32_stream_refill(), called from the main
+ * loop, fills the other.  Both are filled before this returns.  The file
+ * must not be written, deleted or defragmented while it plays and its
+ * cursor stays where it was. */
+Fat32Error fat32_stream_open(Fat32Stream *stream, Fat32File *file,
+                             uint8_t *buffers);
+
+/**
+ * Fills an empty buffer of @param stream with one sector read.  With both
+ * full it looks up the cluster after the current one instead, so crossing
+ * into it later costs no FAT read.  The longest call so far is kept in
+ * worst_us, it has to stay below the time a buffer lasts.
+ * @return false if the card did not deliver, the next call tries again. */
+bool fat32_stream_refill(Fat32Stream *stream);
+
+/**
+ * Copies up to @param len bytes of @param stream into @param buf without
+ * touching the card.  Coming up short before the end of the file means
+ * the refills did not keep up and counts as a miss in misses.
+ * @return number of bytes copied. */
+uint16_t fat32_stream_read(Fat32Stream *stream, char *buf, uint16_t len);
+
 uint32_t fat32_claim_free_cluster(void);
 
+/**
+ * Makes new files start in, and grow through, allocation units of
+ * @param sectors that are still completely free, keeping writes on the
+ * card's fast path.  The size can come from sdcard_request_au_size().
+ * 0 switches back to taking the first free cluster. */
+void fat32_set_au_size(uint32_t sectors);
+
+/**
+ * Counts free clusters in @param max_sectors more FAT sectors, picking up
+ * where the last call stopped.  Meant to be called while idle after
+ * mounting until it is done, the result then replaces the count taken
+ * from FSInfo and goes back into FSInfo.
+ * @return true once fat32_free_count is exact. */
+bool fat32_scan_free(uint16_t max_sectors);
+
+/**
+ * Writes fat32_free_count and fat32_free_hint to FSInfo, so the next
+ * fat32_mount() can trust them.  Call before powering off.  With
+ * FAT32_SNAPSHOT and a known free count the rest of what mounting would
+ * have to find out again goes along. */
+Fat32Error fat32_update_fsinfo(void);
+
 Fat32Error fat32_link_clusters(uint32_t head, uint32_t tail);
 
 Fat32Error fat32_write_file(Fat32File *file, const char *buf, uint16_t len);
 
+/**
+ * Collects writes to @param file in @param buffer (SD_SECTOR_SIZE bytes,
+ * NULL writes straight through again).  A sector is only written once the
+ * cursor leaves it or on fat32_flush(), which is also the only time the
+ * directory entry gets updated. */
+Fat32Error fat32_buffer_writes(Fat32File *file, uint8_t *buffer);
+
+/**
+ * Like fat32_buffer_writes(), but moves the cursor to the end first.  The
+ * tail sector then stays in @param buffer and appends cost no reads. */
+Fat32Error fat32_append_mode(Fat32File *file, uint8_t *buffer);
+
+/**
+ * Writes out what @param file still holds back: the buffered sector and
+ * its directory entry. */
+Fat32Error fat32_flush(Fat32File *file);
+
+/**
+ * Calls fat32_flush() if the oldest change held back by @param file is at
+ * least @param max_age_us old.  Meant to be polled from a timer or loop. */
+Fat32Error fat32_flush_after(Fat32File *file, uint32_t max_age_us);
+
 Fat32Error fat32_delete_file(Fat32File *file);
 
+/**
+ * Deletes every file of the root directory whose name matches
+ * @param pattern ('*' and '?' as wildcards, NULL for any) and for which
+ * @param match returns true (NULL for all), in one pass over the
+ * directory.  Directories and the volume label are left alone.  Each
+ * directory sector is written once, then the chains of up to
+ * FAT32_BULK_CHAINS files at a time are freed together in ascending FAT
+ * sector order.  @param match must not call into fat32.c. */
+Fat32Error fat32_delete_files(const char *pattern, Fat32Filter match,
+                              void *ctx);
+
+/**
+ * Cuts @param file down to @param new_size bytes, larger sizes leave it
+ * alone.  The clusters still needed stay where they are (at least the
+ * first one, so an emptied file is reused without allocating), the rest
+ * is freed in one pass over the chain and the directory entry is written
+ * once. */
+Fat32Error fat32_truncate(Fat32File *file, uint32_t new_size);
+
+/**
+ * Copies @param src into a new file @param dst_name in the root directory
+ * and opens it as @param dst.  All clusters are claimed up front, as one
+ * run where the free space allows, then the data goes across sector runs
+ * at a time (multi-block with FAT32_READ_AHEAD, the pool is the buffer)
+ * without passing through the caller.  The FAT is written once, when the
+ * clusters are claimed, so a crash midway leaves an empty file that
+ * still holds them rather than clusters nothing owns.  The size reaches the
+ * directory entry once everything is written. */
+Fat32Error fat32_copy_file(Fat32File *src, const char *dst_name,
+                           Fat32File *dst);
+
+/**
+ * Makes the files in the root directory contiguous, a little at a time:
+ * each call reads or copies about @param max_sectors sectors (directory,
+ * FAT and data alike), meant to be called while idle.  A fragmented file
+ * is copied to a free run, which is claimed first, then a single
+ * directory entry write switches over to it and the old chain is freed.
+ * A crash in between leaves at worst lost clusters.  Writing to,
+ * truncating or deleting the file drops its copy, so does a chain that
+ * goes on past the size on the card.  Flush handles that hold back writes
+ * before calling it, without FAT32_OPEN_FILES it cannot see them and a
+ * sector written later would land in the freed chain.  Handles opened
+ * before a file got moved have to be opened again.
+ * @return true once a whole pass found nothing left to move. */
+bool fat32_defrag(uint16_t max_sectors);
+
 Fat32Error fat32_create_file(Fat32File *file, const char *name);
 
 Fat32Error fat32_rename_file(Fat32File *file, const char *new_name);
 
+/**
+ * Packs the entries of the root directory to its front, keeping their
+ * order, ends it right behind the last one and frees the clusters that
+ * are left empty.  Lookups and listings stop at the end, so after heavy
+ * churn they scan much less.  Open handles have to be opened again. */
+Fat32Error fat32_compact_dir(void);
+
+#ifdef FAT32_OPEN_FILES
+/**
+ * Opens @param name from a pool of FAT32_OPEN_FILES handles, creating it
+ * if @param create is set and it does not exist.  Handles on the same
+ * file share one record of its size, first cluster, directory entry and
+ * the furthest point of the chain any of them walked to, so opening it
+ * again skips the directory and changes made through one are seen by
+ * all.  Data a handle holds back in its write buffer only reaches the
+ * others once written.  Do not pass pooled handles to
+ * fat32_find_file() or fat32_create_file().
+ * @return NULL if the pool is exhausted or the file cannot be opened. */
+Fat32File *fat32_open(const char *name, bool create);
+
+/**
+ * Flushes @param file and gives the handle back to the pool.  Only takes
+ * handles from fat32_open(), each of them once.
+ * @return FAT32_INVALID_FILE for any other handle, or one closed already. */
+Fat32Error fat32_close(Fat32File *file);
+#endif
+
+#ifdef FAT32_DISCARD
+/**
+ * Clusters freed by fat32_delete_file() are erased on the card right
+ * away, or only by fat32_discard() once @param defer is set. */
+void fat32_defer_discard(bool defer);
+
+/**
+ * Erases the freed cluster runs still pending.
+ * @return FAT32_GENERIC_SD_ERROR if the card refused an erase. */
+Fat32Error fat32_discard(void);
+#endif
+
+#ifdef FAT32_TRACE
+/**
+ * Moves up to @param max of the oldest trace records into @param out.
+ * @return number of records copied. */
+uint16_t fat32_trace_read(Fat32TraceRecord *out, uint16_t max);
+
+/* Records overwritten before they could be read. */
+extern uint32_t fat32_trace_lost;
+#endif
+
 extern uint8_t fat32_sectors_per_cluster;
 extern uint32_t fat32_root_cluster;
 extern uint32_t fat32_fat_start;
 extern uint32_t fat32_data_start;
+extern uint32_t fat32_cluster_count;
+extern uint32_t fat32_free_hint;    /* Where the search for free clusters starts. */
+extern uint32_t fat32_au_clusters;  /* Clusters per AU, 0 if not aligning. */
+extern uint32_t fat32_free_count;   /* FSINFO_UNKNOWN until known. */
 
 #endif /* FAT32_LIB */
@@ -171,6 +171,52 @@ bool sdcard_request_ocr(uint8_t *ocr) {
     return true;
 }
 
+bool sdcard_erase_sectors(uint32_t sector, uint32_t count) {
+    uint32_t last = sector + count - 1;
+    if (!sdcard_is_hcxc) {
+        sector *= SD_SECTOR_SIZE;
+        last *= SD_SECTOR_SIZE;
+    }
+    union SDResponse1 r1;
+    r1.repr = sdcard_send_command_blocking(SD_CMD32_ERASE_WR_BLK_START,
+                                           sector, 8);
+    sdcard_release();
+    if (r1.repr != 0)
+        return false;
+    r1.repr = sdcard_send_command_blocking(SD_CMD33_ERASE_WR_BLK_END, last, 8);
+    sdcard_release();
+    if (r1.repr != 0)
+        return false;
+    r1.repr = sdcard_send_command_blocking(SD_CMD38_ERASE, 0x00000000, 8);
+    // R1b, the card holds MISO low until the erase is done.
+    while (sdcard_transceive(0xff) != 0xff)
+        ;
+    sdcard_release();
+    return r1.repr == 0;
+}
+
+uint32_t sdcard_request_au_size(void) {
+    // 16 KB doubling up to 4 MB, then the odd steps of the spec.
+    static const uint32_t large[] = {8192, 16384, 24576, 32768, 49152, 65536,
+                                     131072};
+    uint8_t status[SD_STATUS_SIZE];
+    union SDResponse1 r1;
+    r1.repr = sdcard_send_app_command_blocking(SD_ACMD13_SD_STATUS,
+                                               0x00000000, 8);
+    if (r1.repr != 0) {
+        sdcard_release();
+        return 0;
+    }
+    sdcard_read(); // second byte of R2
+    sdcard_read_block(status, SD_STATUS_SIZE, 8);
+    uint8_t au = SD_STATUS_AU_SIZE(status);
+    if (au == 0)
+        return 0;
+    if (au <= 9)
+        return 32ul << (au - 1);
+    return large[au - 9];
+}
+
 uint32_t sdcard_calculate_size_csdv1(const uint8_t *csd) {
     uint32_t mult = 2 << (SD_CSDV1_C_SIZE_MULT(csd) + 1);
     uint32_t block_nr = (SD_CSDV1_C_SIZE(csd) + 1) * mult;
@@ -305,6 +351,36 @@ bool sdcard_read_sector(uint32_t sector, uint8_t *data) {
     return true;
 }
 
+bool sdcard_read_sectors(uint32_t sector, uint32_t count, uint8_t *data) {
+    if (!sdcard_is_hcxc) {
+        sector *= SD_SECTOR_SIZE;
+    }
+    union SDResponse1 r1;
+    r1.repr = sdcard_send_command_blocking(SD_CMD18_READ_MULTIPLE_BLOCK,
+                                           sector, 8);
+    bool ok = r1.repr == 0;
+    for (uint32_t i = 0; ok && i < count; ++i) {
+        uint8_t token;
+        while ((token = sdcard_transceive(0xff)) == 0xff)
+            ;
+        if (token != SD_BLOCK_START_BYTE) {
+            ok = false;
+            break;
+        }
+        sdcard_read_buf(data, SD_SECTOR_SIZE);
+        uint16_t crc = sdcard_read() << 8;
+        crc |= sdcard_read();
+        ok = crc == sdcard_calculate_crc16(data, SD_SECTOR_SIZE);
+        data += SD_SECTOR_SIZE;
+    }
+    // The card keeps sending blocks until told to stop, R1b follows.
+    sdcard_send_command_blocking(SD_CMD12_STOP_TRANSMISSION, 0x00000000, 8);
+    while (sdcard_transceive(0xff) != 0xff)
+        ;
+    sdcard_release();
+    return ok;
+}
+
 void sdcard_write_sector(uint32_t sector, uint8_t *data) {
     if (!sdcard_is_hcxc) {
         sector *= SD_SECTOR_SIZE;
@@ -316,3 +392,29 @@ void sdcard_write_sector(uint32_t sector, uint8_t *data) {
     while (sdcard_transceive(0xff) != 0xff)
         ;
 }
+
+void sdcard_write_sectors(uint32_t sector, uint32_t count, uint8_t *data) {
+    if (!sdcard_is_hcxc) {
+        sector *= SD_SECTOR_SIZE;
+    }
+    sdcard_send_command_blocking(SD_CMD25_WRITE_MULTIPLE_BLOCK, sector, 8);
+    for (uint32_t i = 0; i < count; ++i) {
+        uint16_t crc = sdcard_calculate_crc16(data, SD_SECTOR_SIZE);
+        sdcard_transceive(0xff);
+        sdcard_transceive(SD_MULTI_BLOCK_START_BYTE);
+        sdcard_send_blocking(data, SD_SECTOR_SIZE);
+        sdcard_transceive((crc >> 8) & 0xff);
+        sdcard_transceive(crc & 0xff);
+        // data response, then busy while the block is programmed
+        while (sdcard_transceive(0xff) == 0xff)
+            ;
+        while (sdcard_transceive(0xff) != 0xff)
+            ;
+        data += SD_SECTOR_SIZE;
+    }
+    sdcard_transceive(SD_STOP_TRAN_BYTE);
+    sdcard_transceive(0xff);
+    while (sdcard_transceive(0xff) != 0xff)
+        ;
+    sdcard_release();
+}
@@ -10,6 +10,7 @@
 #define SD_NSS 10
 
 #define SD_SECTOR_SIZE 512
+#define SD_MICROS() micros()
 #define SD_CRC_POLY 0b10001001
 #define SD_CMD0_GO_IDLE_STATE 0
 #define SD_CMD2_ALL_SEND_CID 2
@@ -22,8 +23,12 @@
 #define SD_CMD18_READ_MULTIPLE_BLOCK 18
 #define SD_CMD24_WRITE_BLOCK 24
 #define SD_CMD25_WRITE_MULTIPLE_BLOCK 25
+#define SD_CMD32_ERASE_WR_BLK_START 32
+#define SD_CMD33_ERASE_WR_BLK_END 33
+#define SD_CMD38_ERASE 38
 #define SD_CMD55_APP_CMD 55
 #define SD_CMD58_READ_OCR 58
+#define SD_ACMD13_SD_STATUS 13
 #define SD_ACMD41_SD_SEND_OP_COND 41
 
 #define SD_OCR_VDD_2V7_2V8(X) (X[2] & 0b10000000)
@@ -65,12 +70,17 @@
 #define SD_CSDV2_READ_DSR_IMP(X) (bool)((X[6] & 0b00010000) >> 4)
 // next 6 bits reserved... 6: 0b00001111 7: 0b11000000
 #define SD_CSDV2_C_SIZE(X)                                                     \
-    (uint32_t)((((uint32_t)X[7] & 0b00111111) << 10) | ((uint32_t)X[8] << 8) | \
+    (uint32_t)((((uint32_t)X[7] & 0b00111111) << 16) | ((uint32_t)X[8] << 8) | \
                ((uint32_t)X[9]))
 
+#define SD_STATUS_SIZE 64
+#define SD_STATUS_AU_SIZE(X) ((uint8_t)X[10] >> 4)
+
 #define SD_START_BITS (0b01000000)
 
 #define SD_BLOCK_START_BYTE 0xfe
+#define SD_MULTI_BLOCK_START_BYTE 0xfc
+#define SD_STOP_TRAN_BYTE 0xfd
 
 // can be anything, but this pattern was recommended in spec page 40 of
 // version 2.00.
@@ -311,6 +321,18 @@ uint16_t sdcard_request_csd(uint8_t *csd);
  */
 bool sdcard_request_ocr(uint8_t *ocr);
 
+/**
+ * Will erase @param count sectors starting at @param sector, the card may
+ * then treat them as unused.
+ * @return false if the card rejected the range. */
+bool sdcard_erase_sectors(uint32_t sector, uint32_t count);
+
+/**
+ * Will read the AU_SIZE field of the SD Status (ACMD13).
+ * @return Size of the card's allocation unit in sectors, 0 if unknown.
+ */
+uint32_t sdcard_request_au_size(void);
+
 /**
  * This function will properly setup the SD-Card and display information about
  * it on the connected Display. Therefore the GPU must have been initialized
@@ -328,6 +350,14 @@ bool sdcard_init_peripheral(void);
  */
 bool sdcard_read_sector(uint32_t sector, uint8_t *data);
 
+/**
+ * Will read @param count consecutive sectors starting at @param sector into
+ * @param data with a single READ_MULTIPLE_BLOCK command.
+ * @related sdcard_read_sector
+ * @return does the CRC match for every sector?
+ */
+bool sdcard_read_sectors(uint32_t sector, uint32_t count, uint8_t *data);
+
 /**
  * Will write 512 bytes of @param data into sector @param sector.
  * @related sdcard_read_sector
@@ -336,6 +366,13 @@ bool sdcard_read_sector(uint32_t sector, uint8_t *data);
  */
 void sdcard_write_sector(uint32_t sector, uint8_t *data);
 
+/**
+ * Will write @param count consecutive sectors starting at @param sector from
+ * @param data with a single WRITE_MULTIPLE_BLOCK command.
+ * @related sdcard_write_sector
+ */
+void sdcard_write_sectors(uint32_t sector, uint32_t count, uint8_t *data);
+
 extern bool sdcard_ready;
 extern bool sdcard_is_hcxc;
 extern uint8_t sdcard_sector[SD_SECTOR_SIZE];
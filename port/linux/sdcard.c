@@ -0,0 +1,367 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef SDCARD_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "sdcard.h"
+
+bool sdcard_ready = false;
+bool sdcard_is_hcxc = true;
+uint8_t sdcard_sector[SD_SECTOR_SIZE];
+uint32_t sdcard_reads = 0;
+uint32_t sdcard_writes = 0;
+uint32_t sdcard_erases = 0;
+
+static int _fd = -1;
+
+#ifdef SDCARD_URING
+/* Sectors per queued request, larger runs are split over several. */
+#define URING_SLOT_SECTORS 128
+
+static int _ring = -1;            /* -1 while pread()/pwrite() are used. */
+static uint32_t *_sq_head, *_sq_tail, *_sq_mask, *_sq_array;
+static uint32_t *_cq_head, *_cq_tail, *_cq_mask;
+static struct io_uring_cqe *_cqes;
+static struct io_uring_sqe *_sqes;
+static void *_sq_map, *_cq_map;
+static size_t _sq_size, _cq_size, _sqes_size;
+
+/* Writes are copied here and left to complete on their own, reads of
+ * what is still here are served from here. */
+static uint8_t _stage[SDCARD_URING][URING_SLOT_SECTORS * SD_SECTOR_SIZE];
+static uint32_t _stage_sector[SDCARD_URING];
+static uint32_t _stage_count[SDCARD_URING]; /* 0 if the slot is free. */
+static uint32_t _stage_seq[SDCARD_URING];   /* Newer writes count higher. */
+static bool _stage_queued[SDCARD_URING];    /* Not handed to the kernel. */
+static uint32_t _seq = 0;
+static uint32_t _reads_left = 0;
+static bool _read_failed = false;
+static uint32_t _read_len[SDCARD_URING];
+
+static void _uring_close(void) {
+    if (_ring < 0)
+        return;
+    munmap(_sqes, _sqes_size);
+    if (_cq_map != _sq_map)
+        munmap(_cq_map, _cq_size);
+    munmap(_sq_map, _sq_size);
+    close(_ring);
+    _ring = -1;
+}
+
+static void _uring_open(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof (params));
+    /* Up to a full set of writes and of reads in flight. */
+    _ring = syscall(__NR_io_uring_setup, 2 * SDCARD_URING, &params);
+    if (_ring < 0)
+        return;
+    _sq_size = params.sq_off.array + params.sq_entries * sizeof (uint32_t);
+    _cq_size = params.cq_off.cqes
+        + params.cq_entries * sizeof (struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        _sq_size = _cq_size = _sq_size > _cq_size ? _sq_size : _cq_size;
+    _sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+    _sq_map = mmap(NULL, _sq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQ_RING);
+    _cq_map = _sq_map;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) && _sq_map != MAP_FAILED)
+        _cq_map = mmap(NULL, _cq_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_CQ_RING);
+    _sqes = mmap(NULL, _sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQES);
+    /* IORING_OP_READ/WRITE came with the same kernel as RW_CUR_POS. */
+    if (_sq_map == MAP_FAILED || _cq_map == MAP_FAILED || _sqes == MAP_FAILED
+        || !(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(_ring);
+        _ring = -1;
+        return;
+    }
+    uint8_t *sq = _sq_map;
+    uint8_t *cq = _cq_map;
+    _sq_head = (uint32_t *) (sq + params.sq_off.head);
+    _sq_tail = (uint32_t *) (sq + params.sq_off.tail);
+    _sq_mask = (uint32_t *) (sq + params.sq_off.ring_mask);
+    _sq_array = (uint32_t *) (sq + params.sq_off.array);
+    _cq_head = (uint32_t *) (cq + params.cq_off.head);
+    _cq_tail = (uint32_t *) (cq + params.cq_off.tail);
+    _cq_mask = (uint32_t *) (cq + params.cq_off.ring_mask);
+    _cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    memset(_stage_count, 0, sizeof (_stage_count));
+    memset(_stage_queued, 0, sizeof (_stage_queued));
+    _reads_left = 0;
+}
+
+/* Queues a read or write of @param len bytes, tagged with @param tag. */
+static void _uring_push(uint8_t op, void *buf, uint32_t len, uint32_t sector,
+                        uint8_t flags, uint64_t tag) {
+    uint32_t tail = *_sq_tail;
+    uint32_t i = tail & *_sq_mask;
+    struct io_uring_sqe *sqe = &_sqes[i];
+    memset(sqe, 0, sizeof (*sqe));
+    sqe->opcode = op;
+    sqe->flags = flags;
+    sqe->fd = _fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = len;
+    sqe->off = (uint64_t) sector * SD_SECTOR_SIZE;
+    sqe->user_data = tag;
+    _sq_array[i] = i;
+    __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Hands queued requests to the kernel, waits for @param wait completions
+ * and takes in whatever completed.  An interrupted wait returns early, the
+ * callers loop anyway.  A ring that fails otherwise is closed, what was in
+ * flight is lost and pread()/pwrite() take over.
+ * @return false if the ring failed. */
+static bool _uring_enter(uint32_t wait) {
+    uint32_t queued = *_sq_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+    if (syscall(__NR_io_uring_enter, _ring, queued, wait,
+                wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) >= 0) {
+        memset(_stage_queued, 0, sizeof (_stage_queued));
+    } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        sdcard_ready = false;
+        _read_failed = true;
+        _uring_close();
+        memset(_stage_count, 0, sizeof (_stage_count));
+        memset(_stage_queued, 0, sizeof (_stage_queued));
+        _reads_left = 0;
+        return false;
+    }
+    uint32_t head = *_cq_head;
+    while (head != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &_cqes[head & *_cq_mask];
+        if (cqe->user_data < SDCARD_URING) {
+            uint32_t slot = cqe->user_data;
+            if (cqe->res != (int32_t) (_stage_count[slot] * SD_SECTOR_SIZE))
+                sdcard_ready = false;
+            _stage_count[slot] = 0;
+        } else {
+            if (cqe->res != (int32_t) _read_len[cqe->user_data - SDCARD_URING])
+                _read_failed = true;
+            _reads_left--;
+        }
+        head++;
+    }
+    __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Looks for the newest queued write touching @param count sectors from
+ * @param sector.
+ * @return its slot, SDCARD_URING if there is none. */
+static uint8_t _uring_newest(uint32_t sector, uint32_t count) {
+    uint8_t newest = SDCARD_URING;
+    for (uint8_t slot = 0; slot < SDCARD_URING; ++slot)
+        if (_stage_count[slot] && _stage_sector[slot] < sector + count
+            && sector < _stage_sector[slot] + _stage_count[slot]
+            && (newest == SDCARD_URING
+                || _stage_seq[slot] - _stage_seq[newest] < 0x80000000u))
+            newest = slot;
+    return newest;
+}
+
+/* @return true if slot @param slot holds all of @param count sectors from
+ * @param sector. */
+static bool _uring_covers(uint8_t slot, uint32_t sector, uint32_t count) {
+    return sector >= _stage_sector[slot]
+        && sector + count <= _stage_sector[slot] + _stage_count[slot];
+}
+
+/**
+ * Waits until no write touching @param count sectors from @param sector
+ * is queued any more, none at all if count is 0.
+ * @return false if the ring failed meanwhile. */
+static bool _uring_wait_writes(uint32_t sector, uint32_t count) {
+    for (uint8_t slot = 0; slot < SDCARD_URING; ++slot) {
+        while (_stage_count[slot]
+               && (!count || (_stage_sector[slot] < sector + count
+                              && sector < _stage_sector[slot]
+                              + _stage_count[slot]))) {
+            if (!_uring_enter(1))
+                return false;
+        }
+    }
+    return true;
+}
+
+static bool _uring_read(uint32_t sector, uint32_t count, uint8_t *data) {
+    uint8_t slot = _uring_newest(sector, count);
+    if (slot < SDCARD_URING) {
+        if (_uring_covers(slot, sector, count)) {
+            memcpy(data, _stage[slot] + (sector - _stage_sector[slot])
+                   * SD_SECTOR_SIZE, count * SD_SECTOR_SIZE);
+            return true;
+        }
+        if (!_uring_wait_writes(sector, count))
+            return false;
+    }
+    _read_failed = false;
+    while (count) {
+        /* As many pieces at once as the queue takes, writes still queued
+         * go out with them. */
+        for (uint8_t i = 0; count && i < SDCARD_URING; ++i) {
+            uint32_t n = count < URING_SLOT_SECTORS
+                ? count : URING_SLOT_SECTORS;
+            _read_len[i] = n * SD_SECTOR_SIZE;
+            _uring_push(IORING_OP_READ, data, _read_len[i], sector, 0,
+                        SDCARD_URING + i);
+            _reads_left++;
+            sector += n;
+            count -= n;
+            data += n * SD_SECTOR_SIZE;
+        }
+        while (_reads_left) {
+            if (!_uring_enter(_reads_left))
+                return false;
+        }
+    }
+    return !_read_failed;
+}
+
+/* @return false if the ring failed before all of it was queued. */
+static bool _uring_write(uint32_t sector, uint32_t count, uint8_t *data) {
+    while (count) {
+        uint32_t n = count < URING_SLOT_SECTORS ? count : URING_SLOT_SECTORS;
+        uint8_t slot = _uring_newest(sector, n);
+        uint8_t flags = 0;
+        if (slot < SDCARD_URING && _stage_queued[slot]
+            && _uring_covers(slot, sector, n)) {
+            /* Not handed out yet, the new data simply replaces the old. */
+            memcpy(_stage[slot] + (sector - _stage_sector[slot])
+                   * SD_SECTOR_SIZE, data, n * SD_SECTOR_SIZE);
+        } else {
+            /* Writes to the same sectors must not overtake each other. */
+            if (slot < SDCARD_URING)
+                flags = IOSQE_IO_DRAIN;
+            slot = 0;
+            while (_stage_count[slot]) {
+                if (++slot == SDCARD_URING) {
+                    if (!_uring_enter(1))
+                        return false;
+                    slot = 0;
+                }
+            }
+            memcpy(_stage[slot], data, n * SD_SECTOR_SIZE);
+            _stage_sector[slot] = sector;
+            _stage_count[slot] = n;
+            _stage_seq[slot] = ++_seq;
+            _stage_queued[slot] = true;
+            /* Goes out with the next request that has to wait anyway. */
+            _uring_push(IORING_OP_WRITE, _stage[slot], n * SD_SECTOR_SIZE,
+                        sector, flags, slot);
+        }
+        sector += n;
+        count -= n;
+        data += n * SD_SECTOR_SIZE;
+    }
+    return true;
+}
+#endif
+
+bool sdcard_open_image(const char *path) {
+    sdcard_close_image();
+    _fd = open(path, O_RDWR);
+    if (_fd < 0)
+        return false;
+#ifdef SDCARD_URING
+    _uring_open();
+#endif
+    sdcard_reads = 0;
+    sdcard_writes = 0;
+    sdcard_erases = 0;
+    sdcard_ready = true;
+    return true;
+}
+
+void sdcard_close_image(void) {
+#ifdef SDCARD_URING
+    if (_ring >= 0)
+        _uring_wait_writes(0, 0);
+    _uring_close();
+#endif
+    if (_fd >= 0)
+        close(_fd);
+    _fd = -1;
+    sdcard_ready = false;
+}
+
+uint32_t sdcard_micros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
+
+uint32_t sdcard_request_au_size(void) {
+    return 0;
+}
+
+bool sdcard_erase_sectors(uint32_t sector, uint32_t count) {
+    static const uint8_t zero[SD_SECTOR_SIZE];
+    sdcard_erases++;
+#ifdef SDCARD_URING
+    if (_ring >= 0)
+        _uring_wait_writes(sector, count);
+#endif
+    if (fallocate(_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t) sector * SD_SECTOR_SIZE,
+                  (off_t) count * SD_SECTOR_SIZE) == 0)
+        return true;
+    /* The file system cannot punch holes, write the zeros out. */
+    for (uint32_t i = 0; i < count; ++i)
+        if (pwrite(_fd, zero, SD_SECTOR_SIZE,
+                   (off_t) (sector + i) * SD_SECTOR_SIZE) != SD_SECTOR_SIZE)
+            return false;
+    return true;
+}
+
+bool sdcard_read_sector(uint32_t sector, uint8_t *data) {
+    sdcard_reads++;
+#ifdef SDCARD_URING
+    if (_ring >= 0)
+        return _uring_read(sector, 1, data);
+#endif
+    return pread(_fd, data, SD_SECTOR_SIZE, (off_t) sector * SD_SECTOR_SIZE)
+        == SD_SECTOR_SIZE;
+}
+
+bool sdcard_read_sectors(uint32_t sector, uint32_t count, uint8_t *data) {
+    ssize_t len = (ssize_t) count * SD_SECTOR_SIZE;
+    sdcard_reads += count;
+#ifdef SDCARD_URING
+    if (_ring >= 0)
+        return _uring_read(sector, count, data);
+#endif
+    return pread(_fd, data, len, (off_t) sector * SD_SECTOR_SIZE) == len;
+}
+
+void sdcard_write_sector(uint32_t sector, uint8_t *data) {
+    sdcard_writes++;
+#ifdef SDCARD_URING
+    if (_ring >= 0 && _uring_write(sector, 1, data))
+        return;
+#endif
+    if (pwrite(_fd, data, SD_SECTOR_SIZE, (off_t) sector * SD_SECTOR_SIZE)
+        != SD_SECTOR_SIZE)
+        sdcard_ready = false;
+}
+
+void sdcard_write_sectors(uint32_t sector, uint32_t count, uint8_t *data) {
+    ssize_t len = (ssize_t) count * SD_SECTOR_SIZE;
+    sdcard_writes += count;
+#ifdef SDCARD_URING
+    if (_ring >= 0 && _uring_write(sector, count, data))
+        return;
+#endif
+    if (pwrite(_fd, data, len, (off_t) sector * SD_SECTOR_SIZE) != len)
+        sdcard_ready = false;
+}
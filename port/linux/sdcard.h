@@ -0,0 +1,62 @@
+#ifndef SDCARD_LIB
+#define SDCARD_LIB
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SD_SECTOR_SIZE 512
+#define SD_MICROS() sdcard_micros()
+
+/**
+ * Use the disk image at @param path as the card.  Built with
+ * SDCARD_URING defined as a queue depth, requests go through io_uring and
+ * writes complete in the background, sdcard_close_image() waits for them.
+ * @return false if the image could not be opened. */
+bool sdcard_open_image(const char *path);
+
+void sdcard_close_image(void);
+
+/**
+ * @return a monotonic microsecond clock. */
+uint32_t sdcard_micros(void);
+
+/**
+ * An image has no allocation units.
+ * @return 0, pass the size of the target card to fat32_set_au_size(). */
+uint32_t sdcard_request_au_size(void);
+
+/**
+ * Will punch @param count sectors starting at @param sector out of the
+ * image, they read back as zeros.
+ * @return false if the image could not be changed. */
+bool sdcard_erase_sectors(uint32_t sector, uint32_t count);
+
+/**
+ * Will read 512 bytes of @param data from sector @param sector.
+ * @return false on a short read. */
+bool sdcard_read_sector(uint32_t sector, uint8_t *data);
+
+/**
+ * Will read @param count consecutive sectors starting at @param sector.
+ * @return false on a short read. */
+bool sdcard_read_sectors(uint32_t sector, uint32_t count, uint8_t *data);
+
+/**
+ * Will write 512 bytes of @param data into sector @param sector. */
+void sdcard_write_sector(uint32_t sector, uint8_t *data);
+
+/**
+ * Will write @param count consecutive sectors starting at @param sector. */
+void sdcard_write_sectors(uint32_t sector, uint32_t count, uint8_t *data);
+
+extern bool sdcard_ready;
+extern bool sdcard_is_hcxc;
+extern uint8_t sdcard_sector[SD_SECTOR_SIZE];
+
+/* Sector requests since the image was opened. */
+extern uint32_t sdcard_reads;
+extern uint32_t sdcard_writes;
+extern uint32_t sdcard_erases;
+
+#endif /* SDCARD_LIB */
@@ -0,0 +1,23 @@
+#ifndef ARDUINO_SIM_H
+#define ARDUINO_SIM_H
+
+/* Just enough of the Arduino core for port/arduino to build on a PC, the
+ * pins and the clock are backed by the card simulator in sdsim.cpp. */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+#endif /* ARDUINO_SIM_H */
@@ -0,0 +1,36 @@
+#ifndef SPI_SIM_H
+#define SPI_SIM_H
+
+#include "Arduino.h"
+
+#define LSBFIRST 0
+#define MSBFIRST 1
+#define SPI_MODE0 0
+#define SPI_MODE1 1
+#define SPI_MODE2 2
+#define SPI_MODE3 3
+
+class SPISettings {
+public:
+    SPISettings() : clock(4000000) {}
+    SPISettings(uint32_t clock, uint8_t bit_order, uint8_t data_mode)
+        : clock(clock) {
+        (void) bit_order;
+        (void) data_mode;
+    }
+    uint32_t clock;
+};
+
+/* Every transfer() is one byte on the simulated bus. */
+class SPIClass {
+public:
+    void begin(void) {}
+    void end(void) {}
+    void beginTransaction(SPISettings settings);
+    void endTransaction(void) {}
+    uint8_t transfer(uint8_t data);
+};
+
+extern SPIClass SPI;
+
+#endif /* SPI_SIM_H */
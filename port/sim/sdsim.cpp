@@ -0,0 +1,454 @@
+/*
+ * SD card on the other end of SPI.transfer(), backed by a disk image.  Lets
+ * port/arduino/sdcard.cpp run unchanged on a PC: every byte the driver
+ * clocks is fed through the SPI mode state machine of the card, time only
+ * moves with the bus clock and delay(), so runs are exact and repeatable.
+ *
+ * Supported: CMD0, CMD8, CMD9, CMD12, CMD16, CMD17, CMD18, CMD24, CMD25,
+ * CMD32, CMD33, CMD38, CMD55, CMD58, ACMD13 and ACMD41.
+ */
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sdcard.h"
+#include "sdsim.h"
+
+#define BLOCK SD_SECTOR_SIZE
+#define R1_IDLE 0x01
+#define R1_ILLEGAL 0x04
+#define R1_CRC 0x08
+#define R1_ADDRESS 0x20
+#define R1_PARAMETER 0x40
+#define TOKEN_MULTI 0xfc
+#define TOKEN_STOP 0xfd
+#define DATA_ACCEPTED 0x05
+#define DATA_CRC_ERROR 0x0b
+#define DATA_WRITE_ERROR 0x0d
+#define OP_COND_TRIES 3   /* ACMD41 until the card leaves idle. */
+
+typedef enum {
+    RX_NONE,
+    RX_TOKEN,   /* Waiting for the start of a written block. */
+    RX_DATA
+} RxState;
+
+SPIClass SPI;
+SdSimStats sdsim_stats;
+
+static int _fd = -1;
+static SdSimConfig _config;
+static uint32_t _blocks;
+static uint64_t _now;          /* ns */
+static uint32_t _spi_hz = 400000;
+static bool _selected = false;
+static uint32_t _rand;
+
+static uint8_t _cmd[6];
+static uint8_t _cmd_len = 0;
+static bool _app = false;      /* Previous command was CMD55. */
+static bool _idle = true;
+static uint8_t _op_cond = 0;
+
+/* What the card sends next, not before _out_at. */
+static uint8_t _out[BLOCK + 16];
+static uint16_t _out_pos = 0;
+static uint16_t _out_len = 0;
+static uint64_t _out_at = 0;
+static uint64_t _busy_until = 0;
+static uint32_t _busy_after = 0;   /* us of busy once _out is sent. */
+
+static uint32_t _read_addr;
+static uint32_t _reads_left = 0;   /* Blocks CMD17/CMD18 still owe. */
+static bool _read_first;
+
+static RxState _rx = RX_NONE;
+static bool _rx_multi;
+static uint16_t _rx_pos;
+static uint8_t _rx_buf[BLOCK + 2];
+static uint32_t _write_addr;
+
+static uint32_t _erase_first;
+static uint32_t _erase_last;
+
+static uint32_t _random(void) {
+    /* xorshift32 */
+    _rand ^= _rand << 13;
+    _rand ^= _rand >> 17;
+    _rand ^= _rand << 5;
+    return _rand;
+}
+
+static bool _chance(uint32_t ppm) {
+    return ppm && _random() % 1000000 < ppm;
+}
+
+static void _busy(uint32_t us) {
+    _busy_until = _now + (uint64_t) us * 1000;
+    sdsim_stats.busy_us += us;
+}
+
+static void _reply(const uint8_t *data, uint16_t len) {
+    memcpy(_out + _out_len, data, len);
+    _out_len += len;
+}
+
+static void _reply_r1(uint8_t r1) {
+    _reply(&r1, 1);
+}
+
+/* Data token, @param len bytes and their CRC16, after @param delay_us. */
+static void _reply_data(const uint8_t *data, uint16_t len, uint32_t delay_us,
+                        bool may_fail) {
+    uint8_t token = SD_BLOCK_START_BYTE;
+    uint16_t crc = sdcard_calculate_crc16(data, len);
+    if (may_fail && _chance(_config.crc_ppm)) {
+        crc ^= 1 << (_random() % 16);
+        sdsim_stats.crc_errors++;
+    }
+    uint8_t tail[2] = {(uint8_t) (crc >> 8), (uint8_t) crc};
+    _out_at = _now + (uint64_t) delay_us * 1000;
+    _reply(&token, 1);
+    _reply(data, len);
+    _reply(tail, 2);
+}
+
+static bool _address(uint32_t arg, uint32_t *block) {
+    *block = _config.sdsc ? arg / BLOCK : arg;
+    return *block < _blocks;
+}
+
+static void _queue_read(void) {
+    uint8_t data[BLOCK];
+    if (_read_addr >= _blocks) {
+        /* Out of range error token. */
+        _reply_r1(0x08);
+        _reads_left = 0;
+        return;
+    }
+    if (pread(_fd, data, BLOCK, (off_t) _read_addr * BLOCK) != BLOCK)
+        memset(data, 0, BLOCK);
+    _reply_data(data, BLOCK, _read_first ? _config.cmd_us : 0, true);
+    sdsim_stats.blocks_read++;
+    _read_addr++;
+    _read_first = false;
+    if (_reads_left != UINT32_MAX)
+        _reads_left--;
+}
+
+static void _csd(uint8_t *csd) {
+    memset(csd, 0, 16);
+    csd[3] = 0x32;              /* TRAN_SPEED 25 MHz */
+    csd[4] = 0x5b;              /* CCC incl. class 5, erase */
+    csd[5] = 0x59;              /* READ_BL_LEN 9 */
+    if (_config.sdsc) {
+        /* Capacity = (C_SIZE + 1) << (C_SIZE_MULT + 2) blocks. */
+        uint32_t size = _blocks / 512 - 1;
+        if (size > 0xfff)
+            size = 0xfff;
+        csd[6] = size >> 10;
+        csd[7] = size >> 2;
+        csd[8] = size << 6;
+        csd[9] = 0x03;          /* C_SIZE_MULT 7 */
+        csd[10] = 0x80;
+    } else {
+        /* Capacity = (C_SIZE + 1) * 512 KiB. */
+        uint32_t size = _blocks / 1024 - 1;
+        csd[0] = 0x40;
+        csd[7] = (size >> 16) & 0x3f;
+        csd[8] = size >> 8;
+        csd[9] = size;
+    }
+    csd[15] = sdcard_calculate_crc7(csd, 15);
+}
+
+static void _command(void) {
+    uint8_t cmd = _cmd[0] & 0x3f;
+    uint32_t arg = (uint32_t) _cmd[1] << 24 | (uint32_t) _cmd[2] << 16
+        | (uint32_t) _cmd[3] << 8 | _cmd[4];
+    bool app = _app;
+    uint8_t r1 = _idle ? R1_IDLE : 0x00;
+    uint32_t block;
+
+    _app = false;
+    sdsim_stats.commands++;
+    /* A new command drops whatever was still to be sent. */
+    _out_pos = _out_len = 0;
+    _reads_left = 0;
+    /* CRC checking is off in SPI mode, except for the two that precede it. */
+    if ((cmd == SD_CMD0_GO_IDLE_STATE || cmd == SD_CMD8_SEND_IF_COND)
+        && sdcard_calculate_crc7(_cmd, 5) != _cmd[5]) {
+        _reply_r1(r1 | R1_CRC);
+        return;
+    }
+    if (_idle && !app && cmd != SD_CMD0_GO_IDLE_STATE
+        && cmd != SD_CMD8_SEND_IF_COND && cmd != SD_CMD55_APP_CMD
+        && cmd != SD_CMD58_READ_OCR)
+        goto illegal;
+
+    if (app) {
+        switch (cmd) {
+        case SD_ACMD41_SD_SEND_OP_COND:
+            if (++_op_cond >= OP_COND_TRIES)
+                _idle = false;
+            _reply_r1(_idle ? R1_IDLE : 0x00);
+            return;
+        case SD_ACMD13_SD_STATUS: {
+            uint8_t status[SD_STATUS_SIZE] = {0};
+            status[10] = _config.au_size << 4;
+            _reply_r1(r1);
+            _reply_r1(0x00);    /* second byte of R2 */
+            _reply_data(status, sizeof(status), 0, false);
+            return;
+        }
+        }
+        goto illegal;
+    }
+
+    switch (cmd) {
+    case SD_CMD0_GO_IDLE_STATE:
+        _idle = true;
+        _op_cond = 0;
+        _rx = RX_NONE;
+        _reply_r1(R1_IDLE);
+        return;
+    case SD_CMD8_SEND_IF_COND: {
+        if (_config.sdsc)
+            goto illegal;
+        uint8_t r7[5] = {r1, 0x00, 0x00, (uint8_t) ((arg >> 8) & 0x0f),
+                         (uint8_t) arg};
+        _reply(r7, sizeof(r7));
+        return;
+    }
+    case SD_CMD9_SEND_CSD: {
+        uint8_t csd[16];
+        _csd(csd);
+        _reply_r1(r1);
+        _reply_data(csd, sizeof(csd), 0, false);
+        return;
+    }
+    case SD_CMD12_STOP_TRANSMISSION:
+        _reply_r1(r1);
+        return;
+    case SD_CMD16_SET_BLOCK_LEN:
+        _reply_r1(arg == BLOCK ? r1 : r1 | R1_PARAMETER);
+        return;
+    case SD_CMD17_READ_SINGLE_BLOCK:
+    case SD_CMD18_READ_MULTIPLE_BLOCK:
+        if (!_address(arg, &block)) {
+            _reply_r1(r1 | R1_ADDRESS);
+            return;
+        }
+        _reply_r1(r1);
+        _read_addr = block;
+        _read_first = true;
+        _reads_left = cmd == SD_CMD17_READ_SINGLE_BLOCK ? 1 : UINT32_MAX;
+        return;
+    case SD_CMD24_WRITE_BLOCK:
+    case SD_CMD25_WRITE_MULTIPLE_BLOCK:
+        if (!_address(arg, &block)) {
+            _reply_r1(r1 | R1_ADDRESS);
+            return;
+        }
+        _reply_r1(r1);
+        _write_addr = block;
+        _rx = RX_TOKEN;
+        _rx_multi = cmd == SD_CMD25_WRITE_MULTIPLE_BLOCK;
+        return;
+    case SD_CMD32_ERASE_WR_BLK_START:
+    case SD_CMD33_ERASE_WR_BLK_END:
+        if (!_address(arg, &block)) {
+            _reply_r1(r1 | R1_ADDRESS);
+            return;
+        }
+        if (cmd == SD_CMD32_ERASE_WR_BLK_START)
+            _erase_first = block;
+        else
+            _erase_last = block;
+        _reply_r1(r1);
+        return;
+    case SD_CMD38_ERASE: {
+        static const uint8_t zero[BLOCK] = {0};
+        for (uint32_t i = _erase_first; i <= _erase_last; ++i)
+            if (pwrite(_fd, zero, BLOCK, (off_t) i * BLOCK) != BLOCK)
+                break;
+        sdsim_stats.erases++;
+        _reply_r1(r1);
+        _busy_after = _config.erase_us;
+        return;
+    }
+    case SD_CMD55_APP_CMD:
+        _app = true;
+        _reply_r1(r1);
+        return;
+    case SD_CMD58_READ_OCR: {
+        uint8_t ocr[5] = {r1, 0x00, 0xff, 0x80, 0x00};  /* 2.7-3.6 V */
+        if (!_idle)
+            ocr[1] = 0x80 | (_config.sdsc ? 0x00 : 0x40);
+        _reply(ocr, sizeof(ocr));
+        return;
+    }
+    }
+illegal:
+    sdsim_stats.illegal++;
+    _reply_r1(r1 | R1_ILLEGAL);
+}
+
+static void _receive(uint8_t in) {
+    if (_rx == RX_TOKEN) {
+        if (in == (_rx_multi ? TOKEN_MULTI : SD_BLOCK_START_BYTE)) {
+            _rx = RX_DATA;
+            _rx_pos = 0;
+        } else if (_rx_multi && in == TOKEN_STOP) {
+            _rx = RX_NONE;
+        }
+        return;
+    }
+    _rx_buf[_rx_pos++] = in;
+    if (_rx_pos < sizeof(_rx_buf))
+        return;
+    uint16_t crc = (uint16_t) _rx_buf[BLOCK] << 8 | _rx_buf[BLOCK + 1];
+    uint8_t response = DATA_ACCEPTED;
+    if (crc != sdcard_calculate_crc16(_rx_buf, BLOCK)
+        || _chance(_config.reject_ppm))
+        response = DATA_CRC_ERROR;
+    else if (_write_addr >= _blocks
+             || pwrite(_fd, _rx_buf, BLOCK, (off_t) _write_addr * BLOCK)
+             != BLOCK)
+        response = DATA_WRITE_ERROR;
+    if (response == DATA_ACCEPTED) {
+        sdsim_stats.blocks_written++;
+        _busy_after = _config.busy_us;
+    } else {
+        sdsim_stats.rejected++;
+    }
+    _write_addr++;
+    _reply_r1(response);
+    _out_at = _now;
+    _rx = _rx_multi && response == DATA_ACCEPTED ? RX_TOKEN : RX_NONE;
+}
+
+/* The byte the card shifts out while the host shifts one in. */
+static uint8_t _send(void) {
+    if (_now < _busy_until)
+        return 0x00;
+    if (_out_pos == _out_len && _reads_left)
+        _queue_read();
+    if (_out_pos == _out_len || _now < _out_at)
+        return 0xff;
+    uint8_t out = _out[_out_pos++];
+    if (_out_pos == _out_len) {
+        _out_pos = _out_len = 0;
+        if (_busy_after) {
+            _busy(_busy_after);
+            _busy_after = 0;
+        }
+    }
+    return out;
+}
+
+static void _take(uint8_t in) {
+    if (_rx != RX_NONE) {
+        _receive(in);
+        return;
+    }
+    if (_cmd_len == 0 && (in & 0xc0) != SD_START_BITS)
+        return;
+    _cmd[_cmd_len++] = in;
+    if (_cmd_len == sizeof(_cmd)) {
+        _cmd_len = 0;
+        _command();
+    }
+}
+
+bool sdsim_open(const char *path, const SdSimConfig *config) {
+    struct stat st;
+    sdsim_close();
+    _fd = open(path, O_RDWR);
+    if (_fd < 0)
+        return false;
+    if (fstat(_fd, &st) != 0) {
+        sdsim_close();
+        return false;
+    }
+    if (config)
+        _config = *config;
+    else
+        memset(&_config, 0, sizeof(_config));
+    _blocks = st.st_size / BLOCK;
+    _rand = _config.seed ? _config.seed : 1;
+    _spi_hz = 400000;
+    _idle = true;
+    _op_cond = 0;
+    _app = false;
+    _cmd_len = 0;
+    _out_pos = _out_len = 0;
+    _reads_left = 0;
+    _busy_until = _now;
+    _busy_after = 0;
+    _rx = RX_NONE;
+    memset(&sdsim_stats, 0, sizeof(sdsim_stats));
+    return true;
+}
+
+void sdsim_close(void) {
+    if (_fd >= 0)
+        close(_fd);
+    _fd = -1;
+}
+
+uint64_t sdsim_now_ns(void) {
+    return _now;
+}
+
+void SPIClass::beginTransaction(SPISettings settings) {
+    _spi_hz = settings.clock;
+}
+
+uint8_t SPIClass::transfer(uint8_t data) {
+    uint32_t hz = _config.spi_hz ? _config.spi_hz : _spi_hz;
+    _now += 8000000000ull / hz;
+    if (!_selected || _fd < 0)
+        return 0xff;
+    sdsim_stats.bytes++;
+    uint8_t out = _send();
+    _take(data);
+    return out;
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+    (void) pin;
+    (void) mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+    if (pin != SD_NSS)
+        return;
+    _selected = value == LOW;
+    if (!_selected) {
+        /* Deselecting aborts a half sent command and unread data. */
+        _cmd_len = 0;
+        _out_pos = _out_len = 0;
+        _reads_left = 0;
+        if (_busy_after) {
+            _busy(_busy_after);
+            _busy_after = 0;
+        }
+    }
+}
+
+unsigned long micros(void) {
+    return _now / 1000;
+}
+
+unsigned long millis(void) {
+    return _now / 1000000;
+}
+
+void delay(unsigned long ms) {
+    _now += (uint64_t) ms * 1000000;
+}
+
+void delayMicroseconds(unsigned int us) {
+    _now += (uint64_t) us * 1000;
+}
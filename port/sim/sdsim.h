@@ -0,0 +1,47 @@
+#ifndef SDSIM_LIB
+#define SDSIM_LIB
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Timing and error model of the simulated card. */
+typedef struct {
+    uint32_t spi_hz;      /* Bus clock, 0 follows SPI.beginTransaction(). */
+    uint32_t cmd_us;      /* CMD17/CMD18 until the first data token. */
+    uint32_t busy_us;     /* Busy after every written block. */
+    uint32_t erase_us;    /* Busy after CMD38. */
+    uint32_t crc_ppm;     /* Read blocks sent with a broken CRC16, per 1e6. */
+    uint32_t reject_ppm;  /* Written blocks answered with a CRC error. */
+    uint32_t seed;        /* Seeds the error dice, runs are repeatable. */
+    uint8_t au_size;      /* AU_SIZE code reported by ACMD13. */
+    bool sdsc;            /* Byte addressed SDSC card without CMD8. */
+} SdSimConfig;
+
+typedef struct {
+    uint32_t commands;
+    uint32_t illegal;         /* Answered with the illegal command bit. */
+    uint32_t blocks_read;
+    uint32_t blocks_written;
+    uint32_t crc_errors;      /* Read blocks sent with a broken CRC16. */
+    uint32_t rejected;        /* Written blocks that were not stored. */
+    uint32_t erases;
+    uint64_t bytes;           /* Bytes clocked while selected. */
+    uint64_t busy_us;         /* Time spent busy. */
+} SdSimStats;
+
+/**
+ * Puts the card with the image at @param path into the socket, power on
+ * state.  @param config NULL takes the defaults (no latency, no errors).
+ * @return false if the image could not be opened. */
+bool sdsim_open(const char *path, const SdSimConfig *config);
+
+void sdsim_close(void);
+
+/**
+ * @return Simulated time in nanoseconds, advanced by every byte on the bus
+ * and by delay(). */
+uint64_t sdsim_now_ns(void);
+
+extern SdSimStats sdsim_stats;
+
+#endif /* SDSIM_LIB */
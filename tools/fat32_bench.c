@@ -0,0 +1,940 @@
+/*
+ * Benchmarks the fat32.c API on freshly formatted disk images and counts
+ * the sector requests each case costs next to its wall time.  Every case
+ * checks what it wrote, the exit status is non-zero if anything came back
+ * wrong.
+ *
+ * Build:  cc -O2 -I.. -I../port/linux -o fat32_bench fat32_bench.c mkfs.c \
+ *             ../fat32.c ../port/linux/sdcard.c
+ *         (add -DFAT32_DISCARD=8 to also time deletes that erase,
+ *         -DFAT32_OPEN_FILES=4 for the shared handle cases,
+ *         -DFAT32_SNAPSHOT to time mounting from a snapshot,
+ *         -DSDCARD_URING=32 to go through io_uring,
+ *         -DFAT32_TRACE to check the trace ring and record with -t)
+ * Usage:  fat32_bench [-o image] [-i template.img] [-c 1,8,64]
+ *                     [-f 0,50,95] [-d 100,1000,10000,60000] [-s kib]
+ *                     [-n clusters] [-L list_limit] [-a au_sectors]
+ *                     [-t trace.bin]
+ */
+#define _DEFAULT_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fat32.h"
+#include "mkfs.h"
+#include "sdcard.h"
+
+#define SECTOR_SIZE 512
+#define ALIGN_SECTORS 8192        /* 4 MiB */
+#define MAX_LIST 16
+#define CHUNK 4096
+#define SMALL_READ 64
+#define APPEND_RECORD 16
+#define APPEND_COUNT 4096
+#define CHURN_COUNT 500
+#define CHURN_BYTES 100
+#define BULK_COUNT 200
+#define BULK_BYTES 1100
+#define ALLOC_COUNT 256
+#define LINE_COUNT 4096
+#define LINE_MAX 120
+#define TRACE_CHUNK 256
+
+/* Keeps the handle size fat32.h quotes honest. */
+#if UINTPTR_MAX == UINT64_MAX
+#ifdef FAT32_READ_AHEAD
+_Static_assert(sizeof (Fat32File) == 80, "update the size in fat32.h");
+#else
+_Static_assert(sizeof (Fat32File) == 72, "update the size in fat32.h");
+#endif
+#endif
+
+typedef struct {
+    uint32_t reads;
+    uint32_t writes;
+    double start;
+} Sample;
+
+static const char *image = "fat32_bench.img";
+static const char *template_image = NULL;
+static uint32_t cluster_target = 100000;
+static uint32_t seq_bytes = 1024 * 1024;
+static uint32_t list_limit = 10000;
+static uint32_t au_sectors = 0;
+static uint32_t expect_free = 0;  /* Free clusters _prepare() left. */
+static int failures = 0;
+#ifdef FAT32_TRACE
+static FILE *trace_file = NULL;   /* -t, what the ring held goes here. */
+static uint32_t trace_records = 0;
+#endif
+
+static double _now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int _parse_list(char *arg, uint32_t *out) {
+    int n = 0;
+    for (char *p = strtok(arg, ","); p && n < MAX_LIST; p = strtok(NULL, ","))
+        out[n++] = strtoul(p, NULL, 0);
+    return n;
+}
+
+static uint8_t _pattern(uint32_t pos) {
+    return (pos * 7) ^ (pos >> 9);
+}
+
+#ifdef FAT32_TRACE
+/**
+ * Empties the trace ring, into the -t file if there is one.
+ * @return number of records it held. */
+static uint32_t _trace_drain(void) {
+    static Fat32TraceRecord chunk[TRACE_CHUNK];
+    uint32_t total = 0;
+    uint16_t n;
+    while ((n = fat32_trace_read(chunk, TRACE_CHUNK))) {
+        if (trace_file)
+            fwrite(chunk, sizeof (chunk[0]), n, trace_file);
+        total += n;
+    }
+    trace_records += total;
+    return total;
+}
+#else
+#define _trace_drain()
+#endif
+
+static void _begin(Sample *s) {
+    _trace_drain();
+    s->reads = sdcard_reads;
+    s->writes = sdcard_writes;
+    s->start = _now_ms();
+}
+
+static void _end(Sample *s, const char *name, uint8_t spc, uint32_t fill,
+                 uint32_t ops, const char *unit) {
+    double ms = _now_ms() - s->start;
+    uint32_t reads = sdcard_reads - s->reads;
+    uint32_t writes = sdcard_writes - s->writes;
+    printf("%-22s %6u %4u%% %10u %10u %10.2f %10.1f %s/s\n", name,
+           spc * SECTOR_SIZE, fill, reads, writes, ms,
+           ms > 0 ? ops / (ms / 1e3) : 0.0, unit);
+    _trace_drain();
+}
+
+static void _fail(const char *what) {
+    fprintf(stderr, "FAIL: %s\n", what);
+    failures++;
+}
+
+/* Writes a FAT chain over @param count clusters starting at @param first. */
+static void _put_chain(int fd, const MkfsLayout *l, uint32_t first,
+                       uint32_t count) {
+    uint32_t *entries = malloc(count * 4);
+    for (uint32_t i = 0; i < count; ++i)
+        entries[i] = i + 1 == count ? 0x0fffffff : first + i + 1;
+    for (uint8_t f = 0; f < MKFS_NUMBER_OF_FATS; ++f) {
+        off_t off = (off_t) (l->fat_start + f * l->fat_sectors) * SECTOR_SIZE
+            + first * 4;
+        if (pwrite(fd, entries, count * 4, off) != (ssize_t) count * 4)
+            _fail("writing FAT");
+    }
+    free(entries);
+}
+
+/* Makes FSInfo match a volume with @param free clusters left. */
+static void _put_fsinfo(int fd, const MkfsLayout *l, uint32_t free,
+                        uint32_t next_free) {
+    uint8_t sector[SECTOR_SIZE];
+    off_t off = (off_t) (l->part_start + 1) * SECTOR_SIZE;
+    Fat32FsInfo *info = (Fat32FsInfo *) sector;
+    if (pread(fd, sector, SECTOR_SIZE, off) != SECTOR_SIZE)
+        return _fail("reading FSInfo");
+    info->free_count = free;
+    info->next_free = next_free;
+    if (pwrite(fd, sector, SECTOR_SIZE, off) != SECTOR_SIZE)
+        _fail("writing FSInfo");
+}
+
+static void _put_entry(Fat32Entry *e, const char *name, const char *ext,
+                       uint32_t cluster, uint32_t size) {
+    memset(e, 0, sizeof (*e));
+    memset(e->filename, ' ', 8 + 3);
+    memcpy(e->filename, name, strlen(name));
+    memcpy(e->ext, ext, strlen(ext));
+    e->attributes.archive = 1;
+    e->starting_cluster = cluster;
+    e->starting_cluster_high = cluster >> 16;
+    e->file_size = size;
+}
+
+/**
+ * Formats the bench image, fills @param fill percent of the clusters
+ * right behind the root directory with one file and puts @param entries
+ * empty files into the root directory.  Then mounts it. */
+static bool _prepare(uint8_t spc, uint32_t fill, uint32_t entries) {
+    MkfsLayout l;
+    int fd;
+    if (template_image) {
+        char cmd[1024];
+        snprintf(cmd, sizeof (cmd), "cp --sparse=always '%s' '%s'",
+                 template_image, image);
+        if (system(cmd) != 0)
+            return false;
+    } else {
+        uint32_t disk = ALIGN_SECTORS * 2 + MKFS_RESERVED_SECTORS
+            + 2 * ((cluster_target + 2) * 4 / SECTOR_SIZE + 1)
+            + cluster_target * spc;
+        if (!mkfs_layout(&l, disk, spc, ALIGN_SECTORS)) {
+            fprintf(stderr, "cannot lay out %u clusters of %u sectors\n",
+                    cluster_target, spc);
+            return false;
+        }
+        fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, (off_t) disk * SECTOR_SIZE) < 0
+            || !mkfs_write(fd, &l, "BENCH")) {
+            perror(image);
+            return false;
+        }
+
+        uint32_t dir_clusters = (entries + 1) * sizeof (Fat32Entry)
+            / (spc * SECTOR_SIZE) + 1;
+        uint32_t fill_clusters = (uint64_t) l.clusters * fill / 100;
+        if (fill_clusters > l.clusters - dir_clusters)
+            fill_clusters = l.clusters - dir_clusters;
+        _put_chain(fd, &l, 2, dir_clusters);
+
+        /* Root directory: the fill file first, then the empty files. */
+        Fat32Entry *dir = calloc(dir_clusters * spc, SECTOR_SIZE);
+        Fat32Entry *e = dir;
+        if (fill_clusters) {
+            _put_entry(e++, "FILL", "BIN", 2 + dir_clusters,
+                       fill_clusters * spc * SECTOR_SIZE);
+            _put_chain(fd, &l, 2 + dir_clusters, fill_clusters);
+        }
+        for (uint32_t i = 0; i < entries; ++i) {
+            char name[16];
+            snprintf(name, sizeof (name), "F%07u", i);
+            _put_entry(e++, name, "DAT", 0, 0);
+        }
+        expect_free = l.clusters - dir_clusters - fill_clusters;
+        _put_fsinfo(fd, &l, expect_free, 2 + dir_clusters + fill_clusters);
+        /* The root occupies clusters 2 .. 2 + dir_clusters - 1. */
+        ssize_t len = (ssize_t) dir_clusters * spc * SECTOR_SIZE;
+        if (pwrite(fd, dir, len, (off_t) l.data_start * SECTOR_SIZE) != len)
+            _fail("writing root directory");
+        free(dir);
+        close(fd);
+    }
+    if (!sdcard_open_image(image) || fat32_mount() != FAT32_OK) {
+        fprintf(stderr, "cannot mount %s\n", image);
+        return false;
+    }
+    fat32_set_au_size(au_sectors);
+    return true;
+}
+
+static bool _check_append(const char *name) {
+    Fat32File file;
+    char buf[CHUNK];
+    memset(&file, 0, sizeof (file));
+    bool ok = fat32_find_file(&file, name) == FAT32_OK
+        && file.file_size == APPEND_COUNT * APPEND_RECORD;
+    for (uint32_t pos = 0; ok && pos < file.file_size; pos += CHUNK) {
+        ok = fat32_read_file(&file, buf, CHUNK) == CHUNK;
+        for (uint32_t i = 0; ok && i < CHUNK; ++i)
+            ok = (uint8_t) buf[i] == _pattern(pos + i);
+    }
+    return ok;
+}
+
+/* Counts the logs fat32_delete_files() takes, all of them full size. */
+static bool _count_bulk(const Fat32File *file, void *ctx) {
+    if (file->file_size != BULK_BYTES)
+        return false;
+    (*(uint32_t *) ctx)++;
+    return true;
+}
+
+/* Checks that fat32_list() goes through the directory in order. */
+static bool _check_list(const Fat32File *file, void *ctx) {
+    char name[13];
+    snprintf(name, sizeof (name), "F%07u.DAT", (*(uint32_t *) ctx)++);
+    if (strcmp(file->name, name) != 0) {
+        _fail("dir_list_pass");
+        return false;
+    }
+    return true;
+}
+
+static void _bench_data(uint8_t spc, uint32_t fill) {
+    Sample s;
+    Fat32File file;
+    char buf[CHUNK];
+
+    if (!_prepare(spc, fill, 0))
+        return _fail("prepare");
+
+    /* Mounting trusts FSInfo, the free space scan checks it. */
+    if (!sdcard_open_image(image))
+        return _fail("mount");
+    _begin(&s);
+    if (fat32_mount() != FAT32_OK)
+        return _fail("mount");
+    _end(&s, "mount", spc, fill, 1, "op");
+    fat32_set_au_size(au_sectors);
+    _begin(&s);
+    while (!fat32_scan_free(64))
+        ;
+    _end(&s, "scan_free", spc, fill, fat32_cluster_count / 1000, "kcluster");
+    if (!template_image && fat32_free_count != expect_free)
+        _fail("scan_free count");
+
+#ifdef FAT32_SNAPSHOT
+    /* Power cycle with a snapshot, the scan need not be repeated. */
+    fat32_update_fsinfo();
+    _begin(&s);
+    if (fat32_mount() != FAT32_OK)
+        return _fail("mount_warm");
+    _end(&s, "mount_warm", spc, fill, 1, "op");
+    fat32_set_au_size(au_sectors);
+    if (!fat32_scan_free(0) || fat32_free_count != expect_free)
+        _fail("mount_warm scan state");
+#endif
+
+    /* Sequential write. */
+    memset(&file, 0, sizeof (file));
+    _begin(&s);
+    fat32_create_file(&file, "SEQ.BIN");
+    for (uint32_t pos = 0; pos < seq_bytes; pos += CHUNK) {
+        for (uint32_t i = 0; i < CHUNK; ++i)
+            buf[i] = _pattern(pos + i);
+        fat32_write_file(&file, buf, CHUNK);
+    }
+    _end(&s, "seq_write", spc, fill, seq_bytes / 1024, "KiB");
+    if (au_sectors && fill == 0
+        && SECTOR(file.starting_cluster, 0) % au_sectors)
+        _fail("seq_write not AU aligned");
+
+    /* Sequential read. */
+    memset(&file, 0, sizeof (file));
+    _begin(&s);
+    bool ok = fat32_find_file(&file, "SEQ.BIN") == FAT32_OK
+        && file.file_size == seq_bytes;
+    for (uint32_t pos = 0; ok && pos < seq_bytes; pos += CHUNK) {
+        ok = fat32_read_file(&file, buf, CHUNK) == CHUNK;
+        for (uint32_t i = 0; ok && i < CHUNK; ++i)
+            ok = (uint8_t) buf[i] == _pattern(pos + i);
+    }
+    _end(&s, "seq_read", spc, fill, seq_bytes / 1024, "KiB");
+    if (!ok)
+        _fail("seq_read content");
+
+#ifdef FAT32_TRACE
+    /* Reading the first sector of SEQ.BIN starts the trace with a read of
+     * that sector, writing it back shows up as a write of it. */
+    static Fat32TraceRecord trace[FAT32_TRACE_SIZE];
+    memset(&file, 0, sizeof (file));
+    ok = fat32_find_file(&file, "SEQ.BIN") == FAT32_OK;
+    uint32_t seq_first = SECTOR(file.starting_cluster, 0);
+    uint32_t lost = fat32_trace_lost;
+    _trace_drain();
+    ok = ok && fat32_read_file(&file, buf, SECTOR_SIZE) == SECTOR_SIZE;
+    uint16_t n = fat32_trace_read(trace, FAT32_TRACE_SIZE);
+    ok = ok && n && trace[0].sector == seq_first;
+    for (uint16_t i = 0; ok && i < n; ++i)
+        ok = !(trace[i].tag & FAT32_TRACE_WRITE) && trace[i].tag
+            && trace[i].time - trace[0].time < 0x80000000u;
+    file.cursor = 0;
+    ok = ok && fat32_write_file(&file, buf, SECTOR_SIZE) == FAT32_OK
+        && fat32_flush(&file) == FAT32_OK;
+    n = fat32_trace_read(trace, FAT32_TRACE_SIZE);
+    bool written = false;
+    for (uint16_t i = 0; i < n; ++i)
+        written |= trace[i].sector == seq_first
+            && (trace[i].tag & FAT32_TRACE_WRITE);
+    if (!ok || !written || fat32_trace_lost != lost)
+        _fail("trace records");
+    /* More requests than the ring holds: it keeps the newest and counts
+     * the rest as lost. */
+    uint32_t requests = sdcard_reads + sdcard_writes;
+    for (uint32_t pos = SECTOR_SIZE; ok && pos < seq_bytes
+         && sdcard_reads + sdcard_writes - requests <= FAT32_TRACE_SIZE;
+         pos += SECTOR_SIZE)
+        ok = fat32_read_file(&file, buf, SECTOR_SIZE) == SECTOR_SIZE;
+    requests = sdcard_reads + sdcard_writes - requests;
+    uint32_t kept = _trace_drain();
+    if (requests > FAT32_TRACE_SIZE && (kept != FAT32_TRACE_SIZE
+        || fat32_trace_lost - lost != requests - FAT32_TRACE_SIZE))
+        _fail("trace overflow");
+#endif
+
+    /* Sequential read in small chunks. */
+    memset(&file, 0, sizeof (file));
+    _begin(&s);
+    ok = fat32_find_file(&file, "SEQ.BIN") == FAT32_OK;
+    for (uint32_t pos = 0; ok && pos < seq_bytes; pos += SMALL_READ) {
+        ok = fat32_read_file(&file, buf, SMALL_READ) == SMALL_READ;
+        for (uint32_t i = 0; ok && i < SMALL_READ; ++i)
+            ok = (uint8_t) buf[i] == _pattern(pos + i);
+    }
+    _end(&s, "seq_read_64b", spc, fill, seq_bytes / 1024, "KiB");
+    if (!ok)
+        _fail("seq_read_64b content");
+
+    /* Stream it like audio: each tick takes 64 bytes, one refill step
+     * runs in between. */
+    uint8_t stream_buf[2 * SECTOR_SIZE];
+    Fat32Stream stream;
+    memset(&file, 0, sizeof (file));
+    ok = fat32_find_file(&file, "SEQ.BIN") == FAT32_OK;
+    file.cursor = 100;
+    _begin(&s);
+    ok = ok && fat32_stream_open(&stream, &file, stream_buf) == FAT32_OK;
+    for (uint32_t pos = 100; ok && pos < seq_bytes; pos += SMALL_READ) {
+        uint16_t want = seq_bytes - pos < SMALL_READ
+            ? seq_bytes - pos : SMALL_READ;
+        ok = fat32_stream_read(&stream, buf, SMALL_READ) == want;
+        for (uint32_t i = 0; ok && i < want; ++i)
+            ok = (uint8_t) buf[i] == _pattern(pos + i);
+        /* Also at the end of the chain, where there is no next cluster. */
+        ok = ok && fat32_stream_refill(&stream);
+    }
+    _end(&s, "stream_64b", spc, fill, seq_bytes / 1024, "KiB");
+    printf("%-22s %6u %4u%% %10u us worst refill, %u misses\n", "",
+           spc * SECTOR_SIZE, fill, stream.worst_us, stream.misses);
+    if (!ok || stream.misses)
+        _fail("stream_64b content");
+    /* Without refills it runs dry after two sectors. */
+    file.cursor = 0;
+    if (fat32_stream_open(&stream, &file, stream_buf) != FAT32_OK
+        || fat32_stream_read(&stream, buf, 3 * SECTOR_SIZE) != 2 * SECTOR_SIZE
+        || stream.misses != 1)
+        _fail("stream miss count");
+
+    /* Copy within the volume. */
+    Fat32File copy;
+    memset(&file, 0, sizeof (file));
+    fat32_find_file(&file, "SEQ.BIN");
+    _begin(&s);
+    if (fat32_copy_file(&file, "COPY.BIN", &copy) != FAT32_OK)
+        _fail("copy");
+    _end(&s, "copy", spc, fill, seq_bytes / 1024, "KiB");
+    memset(&file, 0, sizeof (file));
+    ok = fat32_find_file(&file, "COPY.BIN") == FAT32_OK
+        && file.file_size == seq_bytes;
+    for (uint32_t pos = 0; ok && pos < seq_bytes; pos += CHUNK) {
+        ok = fat32_read_file(&file, buf, CHUNK) == CHUNK;
+        for (uint32_t i = 0; ok && i < CHUNK; ++i)
+            ok = (uint8_t) buf[i] == _pattern(pos + i);
+    }
+    if (!ok)
+        _fail("copy content");
+    fat32_delete_file(&file);
+
+#ifdef FAT32_OPEN_FILES
+    /* A other handle on SEQ.BIN skips the directory and starts reading
+     * where the one one got to in the chain. */
+    Fat32File *one = fat32_open("SEQ.BIN", false);
+    _begin(&s);
+    Fat32File *other = fat32_open("SEQ.BIN", false);
+    _end(&s, "open_again", spc, fill, 1, "op");
+    ok = one && other && one != other;
+    if (ok) {
+        one->cursor = seq_bytes - 2 * CHUNK;
+        fat32_read_file(one, buf, CHUNK);
+        other->cursor = seq_bytes - CHUNK;
+        _begin(&s);
+        ok = fat32_read_file(other, buf, CHUNK) == CHUNK;
+        _end(&s, "read_shared", spc, fill, CHUNK / 1024, "KiB");
+        for (uint32_t i = 0; ok && i < CHUNK; ++i)
+            ok = (uint8_t) buf[i] == _pattern(seq_bytes - CHUNK + i);
+    }
+    /* Appends through either handle end up in the same entry. */
+    for (uint32_t i = 0; ok && i < 2 * APPEND_RECORD; ++i)
+        buf[i] = _pattern(seq_bytes + i);
+    if (ok) {
+        one->cursor = seq_bytes;
+        fat32_write_file(one, buf, APPEND_RECORD);
+        other->cursor = seq_bytes + APPEND_RECORD;
+        fat32_write_file(other, buf + APPEND_RECORD, APPEND_RECORD);
+        other->cursor = seq_bytes;
+        ok = fat32_read_file(other, buf + CHUNK / 2, CHUNK / 2)
+            == 2 * APPEND_RECORD
+            && memcmp(buf, buf + CHUNK / 2, 2 * APPEND_RECORD) == 0;
+        memset(&file, 0, sizeof (file));
+        ok = ok && fat32_find_file(&file, "SEQ.BIN") == FAT32_OK
+            && file.file_size == seq_bytes + 2 * APPEND_RECORD;
+        ok = ok && fat32_truncate(one, seq_bytes) == FAT32_OK
+            && fat32_read_file(other, buf, CHUNK) == 0;
+    }
+    if (!ok)
+        _fail("open_shared");
+    if (one)
+        fat32_close(one);
+    if (other)
+        fat32_close(other);
+    /* Neither a second close nor a handle from outside the pool touches
+     * the pool. */
+    if ((one && fat32_close(one) != FAT32_INVALID_FILE)
+        || fat32_close(&file) != FAT32_INVALID_FILE)
+        _fail("close_twice");
+#endif
+
+    /* Small appends. */
+    memset(&file, 0, sizeof (file));
+    _begin(&s);
+    fat32_create_file(&file, "APP.LOG");
+    for (uint32_t r = 0; r < APPEND_COUNT; ++r) {
+        for (uint32_t i = 0; i < APPEND_RECORD; ++i)
+            buf[i] = _pattern(r * APPEND_RECORD + i);
+        fat32_write_file(&file, buf, APPEND_RECORD);
+    }
+    _end(&s, "append_16b", spc, fill, APPEND_COUNT, "op");
+    if (!_check_append("APP.LOG"))
+        _fail("append_16b content");
+
+    /* Small appends through the tail sector buffer. */
+    uint8_t tail[SECTOR_SIZE];
+    memset(&file, 0, sizeof (file));
+    _begin(&s);
+    fat32_create_file(&file, "APPM.LOG");
+    fat32_append_mode(&file, tail);
+    for (uint32_t r = 0; r < APPEND_COUNT; ++r) {
+        for (uint32_t i = 0; i < APPEND_RECORD; ++i)
+            buf[i] = _pattern(r * APPEND_RECORD + i);
+        fat32_write_file(&file, buf, APPEND_RECORD);
+    }
+    fat32_flush(&file);
+    _end(&s, "append_16b_mode", spc, fill, APPEND_COUNT, "op");
+    if (!_check_append("APPM.LOG"))
+        _fail("append_16b_mode content");
+
+    /* Lines of varying length read back without copying. */
+    memset(&file, 0, sizeof (file));
+    fat32_create_file(&file, "LINES.LOG");
+    fat32_append_mode(&file, tail);
+    for (uint32_t k = 0; k < LINE_COUNT; ++k) {
+        uint16_t n = k % LINE_MAX;
+        for (uint16_t i = 0; i < n; ++i)
+            buf[i] = 'a' + (k + i) % 26;
+        buf[n] = '\n';
+        fat32_write_file(&file, buf, n + 1);
+    }
+    fat32_flush(&file);
+    memset(&file, 0, sizeof (file));
+    fat32_find_file(&file, "LINES.LOG");
+    const char *line;
+    uint16_t line_len;
+    bool cut;
+    uint32_t lines = 0;
+    ok = true;
+    _begin(&s);
+    while (ok && fat32_read_record(&file, '\n', &line, &line_len, &cut, buf,
+                                   LINE_MAX)) {
+        ok = line_len == lines % LINE_MAX && !cut;
+        for (uint16_t i = 0; ok && i < line_len; ++i)
+            ok = line[i] == (char) ('a' + (lines + i) % 26);
+        lines++;
+    }
+    _end(&s, "read_lines", spc, fill, lines, "line");
+    if (!ok || lines != LINE_COUNT)
+        _fail("read_lines content");
+    /* With a small spill buffer long lines crossing a sector end come in
+     * cut pieces that still add up. */
+    file.cursor = 0;
+    lines = 0;
+    uint16_t have = 0;
+    ok = !fat32_read_record(&file, '\n', &line, &line_len, &cut, buf, 0);
+    while (ok && fat32_read_record(&file, '\n', &line, &line_len, &cut, buf,
+                                   16)) {
+        have += line_len;
+        if (cut)
+            continue;
+        ok = have == lines % LINE_MAX;
+        have = 0;
+        lines++;
+    }
+    if (!ok || lines != LINE_COUNT)
+        _fail("read_lines pieces");
+    fat32_delete_file(&file);
+
+    /* Small records rewritten in place, straight and buffered. */
+    for (int buffered = 0; buffered < 2; ++buffered) {
+        uint8_t sector_buf[SECTOR_SIZE];
+        memset(&file, 0, sizeof (file));
+        _begin(&s);
+        fat32_find_file(&file, "APP.LOG");
+        if (buffered)
+            fat32_buffer_writes(&file, sector_buf);
+        for (uint32_t r = 0; r < APPEND_COUNT; ++r) {
+            for (uint32_t i = 0; i < APPEND_RECORD; ++i)
+                buf[i] = _pattern(r * APPEND_RECORD + i);
+            fat32_write_file(&file, buf, APPEND_RECORD);
+        }
+        fat32_flush(&file);
+        _end(&s, buffered ? "rewrite_16b_buffered" : "rewrite_16b", spc,
+             fill, APPEND_COUNT, "op");
+        if (!_check_append("APP.LOG"))
+            _fail("rewrite_16b content");
+    }
+
+    /* Create, write, delete. */
+    _begin(&s);
+    for (uint32_t i = 0; i < CHURN_COUNT; ++i) {
+        char name[13];
+        snprintf(name, sizeof (name), "C%07u.TMP", i);
+        memset(&file, 0, sizeof (file));
+        fat32_create_file(&file, name);
+        fat32_write_file(&file, buf, CHURN_BYTES);
+        fat32_delete_file(&file);
+    }
+    _end(&s, "churn", spc, fill, CHURN_COUNT, "op");
+    memset(&file, 0, sizeof (file));
+    if (fat32_find_file(&file, "C0000000.TMP") == FAT32_OK)
+        _fail("churn left a file behind");
+
+    /* Expire two sets of logs written side by side, one file at a time
+     * and in one go. */
+    for (uint32_t i = 0; i < 2 * BULK_COUNT; ++i) {
+        char name[13];
+        snprintf(name, sizeof (name), "%c%07u.LOG", 'A' + i % 2, i / 2);
+        memset(&file, 0, sizeof (file));
+        fat32_create_file(&file, name);
+        fat32_write_file(&file, buf, BULK_BYTES);
+    }
+    /* The directory grew, only the data comes back. */
+    uint32_t bulk_clusters = (BULK_BYTES - 1) / (spc * SECTOR_SIZE) + 1;
+    uint32_t bulk_free = fat32_free_count + 2 * BULK_COUNT * bulk_clusters;
+    _begin(&s);
+    for (uint32_t i = 0; i < BULK_COUNT; ++i) {
+        char name[13];
+        snprintf(name, sizeof (name), "A%07u.LOG", i);
+        memset(&file, 0, sizeof (file));
+        if (fat32_find_file(&file, name) != FAT32_OK
+            || fat32_delete_file(&file) != FAT32_OK) {
+            _fail("delete_loop");
+            break;
+        }
+    }
+    _end(&s, "delete_loop", spc, fill, BULK_COUNT, "file");
+    uint32_t bulk_count = 0;
+    _begin(&s);
+    if (fat32_delete_files("B*.LOG", _count_bulk, &bulk_count) != FAT32_OK)
+        _fail("delete_bulk");
+    _end(&s, "delete_bulk", spc, fill, BULK_COUNT, "file");
+    if (bulk_count != BULK_COUNT)
+        _fail("delete_bulk count");
+    if (fat32_free_count != bulk_free)
+        _fail("delete_bulk free count");
+    memset(&file, 0, sizeof (file));
+    if (fat32_find_file(&file, "B0000000.LOG") == FAT32_OK)
+        _fail("delete_bulk left a file behind");
+
+#ifdef FAT32_DISCARD
+    /* Delete a large file, its freed runs get erased. */
+    memset(&file, 0, sizeof (file));
+    fat32_find_file(&file, "SEQ.BIN");
+    uint32_t first = SECTOR(file.starting_cluster, 0);
+    uint32_t erases = sdcard_erases;
+    _begin(&s);
+    fat32_delete_file(&file);
+    _end(&s, "delete_discard", spc, fill, 1, "op");
+    printf("%-22s %6u %4u%% %10u erase commands\n", "", spc * SECTOR_SIZE,
+           fill, sdcard_erases - erases);
+    sdcard_read_sector(first, (uint8_t *) buf);
+    for (uint32_t i = 0; i < SECTOR_SIZE; ++i)
+        if (buf[i]) {
+            _fail("delete_discard left data behind");
+            break;
+        }
+#endif
+
+    /* Cut a file in half, then empty it. */
+    memset(&file, 0, sizeof (file));
+    fat32_create_file(&file, "TRUNC.BIN");
+    for (uint32_t pos = 0; pos < seq_bytes; pos += CHUNK) {
+        for (uint32_t i = 0; i < CHUNK; ++i)
+            buf[i] = _pattern(pos + i);
+        fat32_write_file(&file, buf, CHUNK);
+    }
+    uint32_t cluster_bytes = spc * SECTOR_SIZE;
+    uint32_t half = seq_bytes / 2 + 100;
+    uint32_t free_before = fat32_free_count;
+    uint32_t head = file.starting_cluster;
+    _begin(&s);
+    if (fat32_truncate(&file, half) != FAT32_OK)
+        _fail("truncate");
+    _end(&s, "truncate", spc, fill, 1, "op");
+    if (fat32_free_count - free_before
+        != (seq_bytes + cluster_bytes - 1) / cluster_bytes
+        - (half + cluster_bytes - 1) / cluster_bytes)
+        _fail("truncate free count");
+    memset(&file, 0, sizeof (file));
+    ok = fat32_find_file(&file, "TRUNC.BIN") == FAT32_OK
+        && file.file_size == half;
+    for (uint32_t pos = 0; ok && pos < half; pos += CHUNK) {
+        uint16_t n = half - pos < CHUNK ? half - pos : CHUNK;
+        ok = fat32_read_file(&file, buf, CHUNK) == n;
+        for (uint32_t i = 0; ok && i < n; ++i)
+            ok = (uint8_t) buf[i] == _pattern(pos + i);
+    }
+    if (!ok)
+        _fail("truncate content");
+    if (fat32_truncate(&file, 0) != FAT32_OK || file.starting_cluster != head
+        || IS_VALID_CLUSTER(fat32_get_next_cluster(head)))
+        _fail("truncate to 0");
+    fat32_delete_file(&file);
+
+    /* Two files written in turns interleave, defragment the volume. */
+    static const char *frag_names[2] = {"FRAGA.BIN", "FRAGB.BIN"};
+    Fat32File frag[2];
+    uint32_t frag_bytes = seq_bytes / 4;
+    for (int f = 0; f < 2; ++f) {
+        memset(&frag[f], 0, sizeof (frag[f]));
+        fat32_create_file(&frag[f], frag_names[f]);
+    }
+    for (uint32_t pos = 0; pos < frag_bytes; pos += CHUNK) {
+        for (uint32_t i = 0; i < CHUNK; ++i)
+            buf[i] = _pattern(pos + i);
+        for (int f = 0; f < 2; ++f)
+            fat32_write_file(&frag[f], buf, CHUNK);
+    }
+    /* Compacting the directory midway makes it start over and drop a copy
+     * it was making.  Once compacted it frees no clusters of its own. */
+    fat32_compact_dir();
+    free_before = fat32_free_count;
+    for (int i = 0; i < 4; ++i)
+        fat32_defrag(8);
+    if (fat32_compact_dir() != FAT32_OK)
+        _fail("defrag compact");
+    uint32_t calls = 0;
+    _begin(&s);
+    while (!fat32_defrag(64) && ++calls < 1000000)
+        ;
+    _end(&s, "defrag", spc, fill, calls, "call");
+    if (fat32_free_count != free_before)
+        _fail("defrag free count");
+    for (int f = 0; f < 2; ++f) {
+        memset(&file, 0, sizeof (file));
+        _begin(&s);
+        ok = fat32_find_file(&file, frag_names[f]) == FAT32_OK
+            && file.file_size == frag_bytes;
+        for (uint32_t pos = 0; ok && pos < frag_bytes; pos += CHUNK) {
+            ok = fat32_read_file(&file, buf, CHUNK) == CHUNK;
+            for (uint32_t i = 0; ok && i < CHUNK; ++i)
+                ok = (uint8_t) buf[i] == _pattern(pos + i);
+        }
+        if (f == 1)
+            _end(&s, "defrag_read", spc, fill, frag_bytes / 1024, "KiB");
+        if (!ok)
+            _fail("defrag content");
+    }
+    for (int f = 0; f < 2; ++f) {
+        memset(&file, 0, sizeof (file));
+        fat32_find_file(&file, frag_names[f]);
+        fat32_delete_file(&file);
+    }
+
+    /* Allocation. */
+    _begin(&s);
+    uint32_t last = 0;
+    for (uint32_t i = 0; i < ALLOC_COUNT; ++i) {
+        uint32_t cluster = fat32_claim_free_cluster();
+        if (cluster == last)
+            _fail("alloc returned a cluster twice");
+        last = cluster;
+    }
+    _end(&s, "alloc", spc, fill, ALLOC_COUNT, "op");
+
+#ifdef FAT32_SNAPSHOT
+    /* The snapshot taken above went stale with the first change. */
+    if (fat32_mount() != FAT32_OK || fat32_scan_free(0))
+        _fail("stale snapshot taken");
+#endif
+
+    sdcard_close_image();
+}
+
+static void _bench_dir(uint8_t spc, uint32_t entries) {
+    Sample s;
+    Fat32File file;
+    char name[32];
+    char label[32];
+
+    if (!_prepare(spc, 0, entries))
+        return _fail("prepare");
+
+    snprintf(label, sizeof (label), "dir_scan/%u", entries);
+    memset(&file, 0, sizeof (file));
+    _begin(&s);
+    if (fat32_get_nth_file(&file, entries - 1) != FAT32_OK)
+        _fail("dir_scan");
+    _end(&s, label, spc, 0, 1, "op");
+
+    snprintf(label, sizeof (label), "dir_lookup/%u", entries);
+    snprintf(name, sizeof (name), "F%07u.DAT", entries - 1);
+    _begin(&s);
+    memset(&file, 0, sizeof (file));
+    if (fat32_find_file(&file, name) != FAT32_OK)
+        _fail("dir_lookup hit");
+    memset(&file, 0, sizeof (file));
+    if (fat32_find_file(&file, "MISSING.DAT") == FAT32_OK)
+        _fail("dir_lookup miss");
+    _end(&s, label, spc, 0, 2, "op");
+
+    if (entries <= list_limit) {
+        snprintf(label, sizeof (label), "dir_list/%u", entries);
+        _begin(&s);
+        for (uint32_t n = 0; n < entries; ++n) {
+            memset(&file, 0, sizeof (file));
+            snprintf(name, sizeof (name), "F%07u.DAT", n);
+            if (fat32_get_nth_file(&file, n) != FAT32_OK
+                || strcmp(file.name, name) != 0) {
+                _fail("dir_list");
+                break;
+            }
+        }
+        _end(&s, label, spc, 0, entries, "entry");
+    }
+
+    snprintf(label, sizeof (label), "dir_list_pass/%u", entries);
+    uint32_t listed = 0;
+    _begin(&s);
+    if (fat32_list(_check_list, &listed) != entries || listed != entries)
+        _fail("dir_list_pass count");
+    _end(&s, label, spc, 0, entries, "entry");
+
+    snprintf(label, sizeof (label), "dir_create/%u", entries);
+    _begin(&s);
+    memset(&file, 0, sizeof (file));
+    fat32_create_file(&file, "NEW.DAT");
+    _end(&s, label, spc, 0, 1, "op");
+    memset(&file, 0, sizeof (file));
+    if (fat32_find_file(&file, "NEW.DAT") != FAT32_OK)
+        _fail("dir_create");
+
+    if (entries <= list_limit) {
+        /* Drop the older half like a log directory would, then reuse
+         * the first hole and pack what is left. */
+        uint32_t dropped = entries / 2;
+        for (uint32_t n = 0; n < dropped; ++n) {
+            memset(&file, 0, sizeof (file));
+            if (fat32_get_nth_file(&file, 0) != FAT32_OK
+                || fat32_delete_file(&file) != FAT32_OK) {
+                _fail("dir_drop");
+                break;
+            }
+        }
+        snprintf(label, sizeof (label), "dir_create_hole/%u", entries);
+        _begin(&s);
+        memset(&file, 0, sizeof (file));
+        fat32_create_file(&file, "HOLE.DAT");
+        _end(&s, label, spc, 0, 1, "op");
+        if (file.entry_offset != 0)
+            _fail("dir_create_hole");
+
+        snprintf(label, sizeof (label), "dir_compact/%u", entries);
+        uint32_t free_before = fat32_free_count;
+        _begin(&s);
+        if (fat32_compact_dir() != FAT32_OK)
+            _fail("dir_compact");
+        _end(&s, label, spc, 0, 1, "op");
+        if (fat32_free_count < free_before)
+            _fail("dir_compact free count");
+
+        snprintf(label, sizeof (label), "dir_lookup_packed/%u", entries);
+        snprintf(name, sizeof (name), "F%07u.DAT", entries - 1);
+        _begin(&s);
+        memset(&file, 0, sizeof (file));
+        if (fat32_find_file(&file, name) != FAT32_OK)
+            _fail("dir_lookup_packed hit");
+        memset(&file, 0, sizeof (file));
+        if (fat32_find_file(&file, "MISSING.DAT") == FAT32_OK)
+            _fail("dir_lookup_packed miss");
+        _end(&s, label, spc, 0, 2, "op");
+        /* HOLE.DAT, the kept half and NEW.DAT, in that order. */
+        memset(&file, 0, sizeof (file));
+        if (fat32_get_nth_file(&file, 0) != FAT32_OK
+            || strcmp(file.name, "HOLE.DAT") != 0)
+            _fail("dir_compact order");
+        memset(&file, 0, sizeof (file));
+        if (fat32_get_nth_file(&file, entries - dropped + 1) != FAT32_OK
+            || strcmp(file.name, "NEW.DAT") != 0)
+            _fail("dir_compact order");
+        memset(&file, 0, sizeof (file));
+        if (fat32_get_nth_file(&file, entries - dropped + 2) == FAT32_OK)
+            _fail("dir_compact end");
+        memset(&file, 0, sizeof (file));
+        if (fat32_create_file(&file, "LAST.DAT") != FAT32_OK
+            || fat32_find_file(&file, "LAST.DAT") != FAT32_OK)
+            _fail("dir_compact create");
+    }
+
+    sdcard_close_image();
+}
+
+int main(int argc, char **argv) {
+    uint32_t clusters[MAX_LIST] = { 1, 8, 64 };
+    uint32_t fills[MAX_LIST] = { 0, 50, 95 };
+    uint32_t dirs[MAX_LIST] = { 100, 1000, 10000, 60000 };
+    int nclusters = 3, nfills = 3, ndirs = 4;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:i:c:f:d:s:n:L:a:t:")) != -1) {
+        switch (opt) {
+        case 'o': image = optarg; break;
+        case 'i': template_image = optarg; break;
+        case 'c': nclusters = _parse_list(optarg, clusters); break;
+        case 'f': nfills = _parse_list(optarg, fills); break;
+        case 'd': ndirs = _parse_list(optarg, dirs); break;
+        case 's': seq_bytes = strtoul(optarg, NULL, 0) * 1024; break;
+        case 'n': cluster_target = strtoul(optarg, NULL, 0); break;
+        case 'L': list_limit = strtoul(optarg, NULL, 0); break;
+        case 'a': au_sectors = strtoul(optarg, NULL, 0); break;
+#ifdef FAT32_TRACE
+        case 't':
+            trace_file = fopen(optarg, "wb");
+            if (!trace_file) {
+                perror(optarg);
+                return 2;
+            }
+            break;
+#endif
+        default:
+            fprintf(stderr, "see the top of fat32_bench.c for usage\n");
+            return 2;
+        }
+    }
+    seq_bytes -= seq_bytes % CHUNK;
+
+    printf("%-22s %6s %5s %10s %10s %10s %10s\n", "case", "clust",
+           "fill", "reads", "writes", "ms", "rate");
+    for (int c = 0; c < nclusters; ++c)
+        for (int f = 0; f < nfills; ++f)
+            _bench_data(clusters[c], fills[f]);
+    /* A template image has its own directory, only the data cases apply. */
+    for (int c = 0; !template_image && c < nclusters; ++c)
+        for (int d = 0; d < ndirs; ++d)
+            _bench_dir(clusters[c], dirs[d]);
+
+#ifdef FAT32_TRACE
+    /* fat32_replay needs an image to run the trace against, keep it. */
+    if (trace_file) {
+        fclose(trace_file);
+        printf("trace: %u records, %u lost\n", trace_records,
+               fat32_trace_lost);
+    } else {
+        unlink(image);
+    }
+#else
+    unlink(image);
+#endif
+    if (failures)
+        fprintf(stderr, "%d check(s) failed\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,536 @@
+/*
+ * Checks FAT32 disk images: every FAT copy against the first, the chain of
+ * every file and directory (links out of range, loops, chains running into
+ * free clusters), clusters shared between chains, allocated clusters no
+ * chain reaches and file sizes against chain lengths.  The image is mapped
+ * into memory, so following a chain costs no I/O, and the cluster passes
+ * and chain walks are split across threads.
+ *
+ * Build:  cc -O2 -pthread -I.. -o fat32_fsck fat32_fsck.c
+ * Usage:  fat32_fsck [-j threads] [-m max_reports] [-q] image...
+ * Exit:   0 if every image is clean, 1 if one has problems, 2 if one could
+ *         not be read at all (or memory ran out).
+ */
+#define _DEFAULT_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fat32.h"
+
+#define SECTOR_SIZE 512
+#define MAX_FATS 4
+#define MAX_THREADS 256
+#define PATH_LEN 256
+#define FAT_MASK 0x0fffffff
+#define FAT_BAD 0x0ffffff7
+#define IS_EOC(C) ((C) >= 0x0ffffff8)
+
+typedef enum {
+    P_MIRROR = 0,   /* FAT copy disagrees with the first. */
+    P_LINK,         /* Entry points outside the volume or at a free cluster. */
+    P_LOOP,         /* Chain comes back to itself. */
+    P_CROSS,        /* Cluster reached from two chains. */
+    P_SIZE,         /* File size does not match the chain length. */
+    P_LOST,         /* Allocated cluster no chain reaches. */
+    P_FSINFO,       /* FSInfo free count is off. */
+    P_COUNT
+} Problem;
+
+static const char *problem_names[P_COUNT] = {
+    "fat mirror", "bad link", "loop", "cross-link", "size", "lost", "fsinfo"
+};
+
+/* A file or directory found in the tree, the root is node 0. */
+typedef struct {
+    uint32_t first;
+    uint32_t size;
+    uint32_t parent;
+    bool dir;
+    char path[PATH_LEN];
+} Node;
+
+typedef struct {
+    const uint8_t *base;
+    size_t length;
+    uint8_t spc;
+    uint8_t fats;
+    uint32_t fat_sectors;
+    uint32_t data_start;       /* Sector, relative to base. */
+    uint32_t clusters;
+    uint32_t root;
+    uint32_t fsinfo_free;
+    const uint32_t *fat[MAX_FATS];
+} Volume;
+
+static Volume vol;
+static Node *nodes;
+static uint32_t node_count;
+static uint32_t *owner;        /* Node index + 1 per cluster, 0 if none. */
+static uint64_t *has_pred;     /* Bit per cluster: some entry links to it. */
+static uint64_t *dir_start;    /* Bit per cluster: a directory starts here. */
+static uint32_t problems[P_COUNT];
+static uint32_t free_clusters;
+static uint32_t lost_chains;
+static uint32_t next_node;     /* Work queue for the chain walks. */
+
+static unsigned threads = 1;
+static uint32_t max_reports = 10;
+static bool quiet = false;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void _report(Problem p, const char *fmt, ...) {
+    uint32_t n = __atomic_fetch_add(&problems[p], 1, __ATOMIC_RELAXED);
+    if (quiet || n >= max_reports)
+        return;
+    va_list ap;
+    va_start(ap, fmt);
+    pthread_mutex_lock(&report_lock);
+    printf("  %-10s ", problem_names[p]);
+    vprintf(fmt, ap);
+    putchar('\n');
+    pthread_mutex_unlock(&report_lock);
+    va_end(ap);
+}
+
+static const uint8_t *_cluster_data(uint32_t cluster) {
+    return vol.base + ((size_t) vol.data_start
+                       + (size_t) (cluster - 2) * vol.spc) * SECTOR_SIZE;
+}
+
+static bool _in_volume(uint32_t cluster) {
+    return cluster >= 2 && cluster < vol.clusters + 2;
+}
+
+/* Runs @param fn on every thread, each gets its index. */
+static void _parallel(void *(*fn)(void *)) {
+    pthread_t t[MAX_THREADS];
+    for (uintptr_t i = 0; i < threads; ++i)
+        pthread_create(&t[i], NULL, fn, (void *) i);
+    for (unsigned i = 0; i < threads; ++i)
+        pthread_join(t[i], NULL);
+}
+
+/* The clusters thread @param index looks at in the cluster passes. */
+static void _slice(uintptr_t index, uint32_t *first, uint32_t *end) {
+    /* Whole 64 cluster words, so bitmap updates never share a word. */
+    uint32_t words = (vol.clusters + 2 + 63) / 64;
+    uint32_t per = (words + threads - 1) / threads;
+    *first = index * per * 64;
+    *end = (index + 1) * per * 64;
+    if (*first < 2)
+        *first = 2;
+    if (*end > vol.clusters + 2)
+        *end = vol.clusters + 2;
+}
+
+/* Pass 1: FAT copies, links and predecessors, free clusters. */
+static void *_check_fat(void *arg) {
+    uint32_t first, end, free = 0;
+    _slice((uintptr_t) arg, &first, &end);
+    for (uint32_t c = first; c < end; ++c) {
+        uint32_t next = vol.fat[0][c] & FAT_MASK;
+        for (uint8_t f = 1; f < vol.fats; ++f)
+            if ((vol.fat[f][c] & FAT_MASK) != next)
+                _report(P_MIRROR, "cluster %u: FAT%u has %#x, FAT1 %#x", c,
+                        f + 1, vol.fat[f][c] & FAT_MASK, next);
+        if (IS_FREE_CLUSTER(next)) {
+            free++;
+        } else if (!IS_EOC(next) && next != FAT_BAD) {
+            if (!_in_volume(next))
+                _report(P_LINK, "cluster %u links to %#x", c, next);
+            else
+                __atomic_fetch_or(&has_pred[next / 64],
+                                  (uint64_t) 1 << (next % 64),
+                                  __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_fetch_add(&free_clusters, free, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/* Pass 3: follows the chain of every node, claiming its clusters. */
+static void *_check_chains(void *arg) {
+    (void) arg;
+    uint32_t cluster_bytes = vol.spc * SECTOR_SIZE;
+    uint32_t n;
+    while ((n = __atomic_fetch_add(&next_node, 1, __ATOMIC_RELAXED))
+           < node_count) {
+        Node *node = &nodes[n];
+        uint32_t length = 0;
+        uint32_t c = node->first;
+        bool broken = true;
+        while (_in_volume(c)) {
+            uint32_t seen = 0;
+            if (!__atomic_compare_exchange_n(&owner[c], &seen, n + 1, false,
+                                             __ATOMIC_RELAXED,
+                                             __ATOMIC_RELAXED)) {
+                if (seen == n + 1)
+                    _report(P_LOOP, "%s: cluster %u again after %u clusters",
+                            node->path, c, length);
+                else
+                    _report(P_CROSS, "%s and %s share cluster %u",
+                            node->path, nodes[seen - 1].path, c);
+                break;
+            }
+            length++;
+            uint32_t next = vol.fat[0][c] & FAT_MASK;
+            if (IS_EOC(next)) {
+                broken = false;
+                break;
+            }
+            /* Links out of the volume were reported by the FAT pass. */
+            if (_in_volume(next)
+                && IS_FREE_CLUSTER(vol.fat[0][next] & FAT_MASK))
+                _report(P_LINK, "%s: cluster %u links to free cluster %u",
+                        node->path, c, next);
+            c = next;
+        }
+        if (!node->first)
+            broken = false;
+        if (node->first && !_in_volume(node->first))
+            _report(P_LINK, "%s starts at invalid cluster %#x", node->path,
+                    node->first);
+        else if (node->first
+                 && IS_FREE_CLUSTER(vol.fat[0][node->first] & FAT_MASK))
+            _report(P_LINK, "%s starts at free cluster %u", node->path,
+                    node->first);
+        if (broken)
+            continue;
+        if (node->dir) {
+            if (!length)
+                _report(P_SIZE, "%s: directory without clusters",
+                        node->path);
+            continue;
+        }
+        /* Our own create_file() hands empty files a cluster already. */
+        uint32_t want = (node->size + cluster_bytes - 1) / cluster_bytes;
+        if (length != want && !(node->size == 0 && length == 1))
+            _report(P_SIZE, "%s: %u bytes need %u clusters, chain has %u",
+                    node->path, node->size, want, length);
+    }
+    return NULL;
+}
+
+/* Pass 4: allocated clusters nobody owns. */
+static void *_check_lost(void *arg) {
+    uint32_t first, end, heads = 0;
+    _slice((uintptr_t) arg, &first, &end);
+    for (uint32_t c = first; c < end; ++c) {
+        uint32_t entry = vol.fat[0][c] & FAT_MASK;
+        if (IS_FREE_CLUSTER(entry) || entry == FAT_BAD || owner[c])
+            continue;
+        bool head = !(has_pred[c / 64] >> (c % 64) & 1);
+        if (head) {
+            heads++;
+            _report(P_LOST, "chain starting at cluster %u", c);
+        } else {
+            __atomic_fetch_add(&problems[P_LOST], 1, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_fetch_add(&lost_chains, heads, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/* @return false if there is no memory left for it. */
+static bool _add_node(uint32_t parent, const Fat32Entry *e) {
+    static uint32_t capacity = 0;
+    if (node_count == capacity) {
+        uint32_t more = capacity ? capacity * 2 : 1024;
+        Node *grown = realloc(nodes, more * sizeof (Node));
+        if (!grown)
+            return false;
+        nodes = grown;
+        capacity = more;
+    }
+    Node *node = &nodes[node_count];
+    memset(node, 0, sizeof (*node));
+    node->parent = parent;
+    if (!e) {
+        node->first = vol.root;
+        node->dir = true;
+        strcpy(node->path, "/");
+        node_count++;
+        return true;
+    }
+    node->first = ENTRY_CLUSTER(e);
+    node->size = e->file_size;
+    node->dir = e->attributes.directory;
+    char name[13];
+    int len = 0;
+    for (int i = 0; i < 8 && e->filename[i] != ' '; ++i)
+        name[len++] = e->filename[i];
+    if (e->ext[0] != ' ') {
+        name[len++] = '.';
+        for (int i = 0; i < 3 && e->ext[i] != ' '; ++i)
+            name[len++] = e->ext[i];
+    }
+    name[len] = 0;
+    char path[PATH_LEN + sizeof (name)];
+    snprintf(path, sizeof (path), "%s%s%s", nodes[parent].path,
+             parent ? "/" : "", name);
+    path[PATH_LEN - 1] = 0;
+    memcpy(node->path, path, PATH_LEN);
+    node_count++;
+    return true;
+}
+
+/**
+ * Marks @param cluster as the start of a directory.
+ * @return false if one started there already. */
+static bool _claim_dir(uint32_t cluster) {
+    if (!_in_volume(cluster))
+        return true;
+    uint64_t bit = (uint64_t) 1 << (cluster % 64);
+    if (dir_start[cluster / 64] & bit)
+        return false;
+    dir_start[cluster / 64] |= bit;
+    return true;
+}
+
+/**
+ * Pass 2: collects every entry of the tree, breadth first.  A directory
+ * starting where another one does is reported and not entered, else one
+ * pointing back at a parent would be queued forever.
+ * @return false if it ran out of memory. */
+static bool _walk_tree(void) {
+    uint32_t per_cluster = vol.spc * SECTOR_SIZE / sizeof (Fat32Entry);
+    node_count = 0;
+    if (!_add_node(0, NULL))
+        return false;
+    _claim_dir(vol.root);
+    for (uint32_t n = 0; n < node_count; ++n) {
+        if (!nodes[n].dir)
+            continue;
+        /* Loops are reported by the chain pass, only stop here. */
+        uint32_t c = nodes[n].first;
+        for (uint32_t hops = 0; _in_volume(c) && hops < vol.clusters;
+             ++hops) {
+            const Fat32Entry *e = (const Fat32Entry *) _cluster_data(c);
+            for (uint32_t i = 0; i < per_cluster; ++i, ++e) {
+                if (e->filename[0] == 0)
+                    goto next_dir;
+                if (e->filename[0] == '\xe5' || e->filename[0] == '.'
+                    || IS_NAME_EXT(e->attributes) || e->attributes.volume_id)
+                    continue;
+                uint32_t first = ENTRY_CLUSTER(e);
+                if (e->attributes.directory && !_claim_dir(first)) {
+                    uint32_t up = n;
+                    while (up && nodes[up].first != first)
+                        up = nodes[up].parent;
+                    if (nodes[up].first == first)
+                        _report(P_LOOP, "%s: directory at cluster %u leads "
+                                "back to %s", nodes[n].path, first,
+                                nodes[up].path);
+                    else
+                        _report(P_CROSS, "%s: directory at cluster %u "
+                                "starts inside another directory",
+                                nodes[n].path, first);
+                    continue;
+                }
+                if (!_add_node(n, e))
+                    return false;
+            }
+            c = vol.fat[0][c] & FAT_MASK;
+        }
+next_dir:;
+    }
+    return true;
+}
+
+/**
+ * Finds the FAT32 partition in the image mapped at @param base and fills
+ * in vol.
+ * @return false if there is none. */
+static bool _open_volume(const uint8_t *base, size_t length) {
+    if (length < SECTOR_SIZE
+        || *(uint16_t *) (base + SECTOR_SIZE - 2) != BOOT_SIGNATURE)
+        return false;
+    const PartitionTable *pt = (const PartitionTable *) (base
+                                                         + PARTITION_TABLE_OFFSET);
+    uint32_t start = 0;
+    for (int i = 0; i < 4 && !start; ++i)
+        if (pt[i].partition_type == FAT32_PT_TYPE
+            || pt[i].partition_type == 0x0c)
+            start = pt[i].start_sector;
+    /* Superfloppy: the boot sector comes first. */
+    const Fat32BootSector *bs = (const Fat32BootSector *) (base
+                                                           + (size_t) start
+                                                           * SECTOR_SIZE);
+    if ((size_t) (start + 1) * SECTOR_SIZE > length
+        || bs->sector_size != SECTOR_SIZE || !bs->sectors_per_cluster
+        || !bs->number_of_fats || bs->number_of_fats > MAX_FATS
+        || !bs->fat_size_sectors)
+        return false;
+
+    memset(&vol, 0, sizeof (vol));
+    vol.base = base;
+    vol.length = length;
+    vol.spc = bs->sectors_per_cluster;
+    vol.fats = bs->number_of_fats;
+    vol.fat_sectors = bs->fat_size_sectors;
+    vol.root = bs->cluster_num_for_root;
+    uint32_t fat_start = start + bs->reserved_sectors;
+    vol.data_start = fat_start + vol.fats * vol.fat_sectors;
+    uint32_t total = bs->total_sectors_u16 ? bs->total_sectors_u16
+        : bs->total_sectors_u32;
+    vol.clusters = (total - (vol.data_start - start)) / vol.spc;
+    /* Never trust the boot sector further than the FAT and image go. */
+    if (vol.clusters + 2 > vol.fat_sectors * (SECTOR_SIZE / 4))
+        vol.clusters = vol.fat_sectors * (SECTOR_SIZE / 4) - 2;
+    if ((size_t) vol.data_start * SECTOR_SIZE > length)
+        return false;
+    size_t room = (length / SECTOR_SIZE - vol.data_start) / vol.spc;
+    if (vol.clusters > room)
+        vol.clusters = room;
+    for (uint8_t f = 0; f < vol.fats; ++f)
+        vol.fat[f] = (const uint32_t *) (base + ((size_t) fat_start
+                                                 + f * vol.fat_sectors)
+                                         * SECTOR_SIZE);
+
+    vol.fsinfo_free = FSINFO_UNKNOWN;
+    const Fat32FsInfo *info = (const Fat32FsInfo *) (base
+                                                     + (size_t) (start
+                                                                 + bs->sector_fsinfo)
+                                                     * SECTOR_SIZE);
+    if (bs->sector_fsinfo && bs->sector_fsinfo < bs->reserved_sectors
+        && info->lead_signature == FSINFO_LEAD_SIGNATURE
+        && info->struct_signature == FSINFO_STRUCT_SIGNATURE
+        && info->trail_signature == FSINFO_TRAIL_SIGNATURE)
+        vol.fsinfo_free = info->free_count;
+    return true;
+}
+
+/**
+ * Runs the passes after the tree walk and prints the summary for @param
+ * path.
+ * @return 0 if clean, 1 on problems. */
+static int _finish(const char *path) {
+    _parallel(_check_chains);
+    _parallel(_check_lost);
+    if (vol.fsinfo_free != FSINFO_UNKNOWN && vol.fsinfo_free != free_clusters)
+        _report(P_FSINFO, "free count %u, FAT has %u", vol.fsinfo_free,
+                free_clusters);
+
+    uint32_t total = 0, dirs = 0;
+    for (int p = 0; p < P_COUNT; ++p)
+        total += problems[p];
+    for (uint32_t n = 0; n < node_count; ++n)
+        dirs += nodes[n].dir;
+    printf("%s: %u files, %u directories, %u of %u clusters used, ",
+           path, node_count - dirs, dirs, vol.clusters - free_clusters,
+           vol.clusters);
+    if (!total) {
+        printf("clean\n");
+    } else {
+        printf("%u problems (", total);
+        const char *sep = "";
+        for (int p = 0; p < P_COUNT; ++p) {
+            if (!problems[p])
+                continue;
+            printf("%s%u %s", sep, problems[p], problem_names[p]);
+            if (p == P_LOST)
+                printf(" in %u chains", lost_chains);
+            sep = ", ";
+        }
+        printf(")\n");
+    }
+    return total ? 1 : 0;
+}
+
+/**
+ * Runs every check on @param path.
+ * @return 0 if clean, 1 on problems, 2 if the image is unusable. */
+static int _check(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        return 2;
+    }
+    uint8_t *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror(path);
+        return 2;
+    }
+    madvise(base, st.st_size, MADV_WILLNEED);
+    if (!_open_volume(base, st.st_size)) {
+        fprintf(stderr, "%s: no FAT32 file system\n", path);
+        munmap(base, st.st_size);
+        return 2;
+    }
+    if (!quiet)
+        printf("%s\n", path);
+
+    memset(problems, 0, sizeof (problems));
+    free_clusters = 0;
+    lost_chains = 0;
+    next_node = 0;
+    size_t words = (vol.clusters + 2 + 63) / 64;
+    has_pred = calloc(words, sizeof (uint64_t));
+    dir_start = calloc(words, sizeof (uint64_t));
+    owner = calloc(vol.clusters + 2, sizeof (uint32_t));
+    int status = 2;
+    if (has_pred && dir_start && owner) {
+        _parallel(_check_fat);
+        if (_walk_tree())
+            status = _finish(path);
+    }
+    if (status == 2)
+        fprintf(stderr, "%s: out of memory\n", path);
+
+    free(owner);
+    free(dir_start);
+    free(has_pred);
+    munmap(base, st.st_size);
+    return status;
+}
+
+static void _usage(void) {
+    fprintf(stderr, "usage: fat32_fsck [-j threads] [-m max_reports] [-q] "
+            "image...\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? cpus : 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:m:q")) != -1) {
+        switch (opt) {
+        case 'j':
+            threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            max_reports = strtoul(optarg, NULL, 0);
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        default:
+            _usage();
+        }
+    }
+    if (optind == argc)
+        _usage();
+    if (threads < 1)
+        threads = 1;
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+
+    int status = 0;
+    for (int i = optind; i < argc; ++i) {
+        int s = _check(argv[i]);
+        if (s > status)
+            status = s;
+    }
+    free(nodes);
+    return status;
+}
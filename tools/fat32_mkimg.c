@@ -0,0 +1,416 @@
+/*
+ * Builds a FAT32 disk image from a directory tree.  Every file gets one
+ * contiguous extent; files of at least an allocation unit start on an AU
+ * boundary, smaller ones fill the gaps behind them.  The FAT and the
+ * directories are put together in memory and written once, file data is
+ * streamed in with large sequential writes.  Names have to fit 8.3, they
+ * are stored in upper case.
+ *
+ * Build:  cc -O2 -I.. -o fat32_mkimg fat32_mkimg.c mkfs.c
+ * Usage:  fat32_mkimg [-s size_mib] [-c sectors_per_cluster]
+ *                     [-a au_sectors] [-L label] -o image dir
+ */
+#define _DEFAULT_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fat32.h"
+#include "mkfs.h"
+
+#define SECTOR_SIZE 512
+#define BOOT_BACKUP_SECTOR 6
+#define PATH_LEN 4096
+#define COPY_CHUNK (4 << 20)
+#define EOC 0x0fffffff
+
+/* A file or directory of the tree, the root is node 0. */
+typedef struct {
+    char path[PATH_LEN];
+    char name[11];              /* As stored in the entry, space padded. */
+    uint32_t parent;
+    uint32_t entries;           /* Children, directories only. */
+    bool dir;
+    uint64_t size;
+    time_t mtime;
+    uint32_t first;             /* First cluster, 0 if none. */
+    uint32_t clusters;
+} Node;
+
+/* A run of free clusters left in front of an AU boundary. */
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+} Gap;
+
+static Node *nodes;
+static uint32_t node_count;
+static uint32_t node_capacity;
+static Gap *gaps;
+static uint32_t gap_count;
+static uint32_t cluster_bytes;
+
+static uint32_t _add_node(void) {
+    if (node_count == node_capacity) {
+        node_capacity = node_capacity ? node_capacity * 2 : 256;
+        nodes = realloc(nodes, node_capacity * sizeof (Node));
+    }
+    memset(&nodes[node_count], 0, sizeof (Node));
+    return node_count++;
+}
+
+static bool _valid_char(char c) {
+    return isupper((unsigned char) c) || isdigit((unsigned char) c)
+        || (c && strchr("!#$%&'()-@^_`{}~", c));
+}
+
+/**
+ * Turns @param src into the space padded 8.3 form in @param dest.
+ * @return false if it does not fit. */
+static bool _short_name(char *dest, const char *src) {
+    const char *dot = strrchr(src, '.');
+    size_t base = dot ? (size_t) (dot - src) : strlen(src);
+    size_t ext = dot ? strlen(dot + 1) : 0;
+    if (base == 0 || base > 8 || ext > 3 || (dot && ext == 0))
+        return false;
+    memset(dest, ' ', 11);
+    for (size_t i = 0; i < base + ext; ++i) {
+        char c = toupper((unsigned char) (i < base ? src[i]
+                                          : dot[1 + i - base]));
+        if (!_valid_char(c))
+            return false;
+        dest[i < base ? i : 8 + i - base] = c;
+    }
+    return true;
+}
+
+/* Collects the tree below @param root breadth first. */
+static bool _scan(const char *root) {
+    struct stat st;
+    uint32_t n = _add_node();
+    snprintf(nodes[n].path, PATH_LEN, "%s", root);
+    nodes[n].dir = true;
+    for (n = 0; n < node_count; ++n) {
+        if (!nodes[n].dir)
+            continue;
+        DIR *d = opendir(nodes[n].path);
+        if (!d) {
+            perror(nodes[n].path);
+            return false;
+        }
+        struct dirent *de;
+        while ((de = readdir(d))) {
+            if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                continue;
+            char path[PATH_LEN];
+            if (snprintf(path, PATH_LEN, "%s/%s", nodes[n].path, de->d_name)
+                >= PATH_LEN || stat(path, &st) < 0) {
+                perror(path);
+                return false;
+            }
+            uint32_t c = _add_node();
+            Node *child = &nodes[c];
+            memcpy(child->path, path, PATH_LEN);
+            if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+                node_count--;
+                continue;
+            }
+            if (!_short_name(child->name, de->d_name)) {
+                fprintf(stderr, "%s: name does not fit 8.3\n", child->path);
+                return false;
+            }
+            if (S_ISREG(st.st_mode) && st.st_size > 0xffffffffLL) {
+                fprintf(stderr, "%s: larger than 4 GiB\n", child->path);
+                return false;
+            }
+            child->parent = n;
+            child->dir = S_ISDIR(st.st_mode);
+            child->size = child->dir ? 0 : st.st_size;
+            child->mtime = st.st_mtime;
+            nodes[n].entries++;
+        }
+        closedir(d);
+    }
+    return true;
+}
+
+/* Clusters each node needs, directories keep room for their end marker. */
+static uint64_t _size_nodes(void) {
+    uint64_t total = 0;
+    for (uint32_t n = 0; n < node_count; ++n) {
+        Node *node = &nodes[n];
+        uint64_t bytes = node->dir
+            ? (node->entries + (n ? 2 : 0) + 1) * sizeof (Fat32Entry)
+            : node->size;
+        node->clusters = (bytes + cluster_bytes - 1) / cluster_bytes;
+        total += node->clusters;
+    }
+    return total;
+}
+
+static void _add_gap(uint32_t first, uint32_t count) {
+    if (!count)
+        return;
+    gaps = realloc(gaps, (gap_count + 1) * sizeof (Gap));
+    gaps[gap_count].first = first;
+    gaps[gap_count++].count = count;
+}
+
+/* Larger files first, so the small ones can fill in behind them. */
+static int _by_size(const void *a, const void *b) {
+    const Node *x = &nodes[*(const uint32_t *) a];
+    const Node *y = &nodes[*(const uint32_t *) b];
+    return (x->clusters < y->clusters) - (x->clusters > y->clusters);
+}
+
+/**
+ * Gives every node its extent: directories packed from cluster 2 on, then
+ * files.
+ * @return first cluster behind everything placed, 0 if it does not fit. */
+static uint32_t _place(uint32_t clusters, uint32_t au_clusters) {
+    uint32_t next = 2;
+    for (uint32_t n = 0; n < node_count; ++n) {
+        if (!nodes[n].dir)
+            continue;
+        nodes[n].first = next;
+        next += nodes[n].clusters;
+    }
+
+    uint32_t *order = malloc(node_count * sizeof (uint32_t));
+    uint32_t files = 0;
+    for (uint32_t n = 0; n < node_count; ++n)
+        if (!nodes[n].dir && nodes[n].clusters)
+            order[files++] = n;
+    qsort(order, files, sizeof (uint32_t), _by_size);
+    for (uint32_t i = 0; i < files; ++i) {
+        Node *node = &nodes[order[i]];
+        if (au_clusters > 1 && node->clusters >= au_clusters) {
+            uint32_t skew = (next - 2) % au_clusters;
+            if (skew) {
+                _add_gap(next, au_clusters - skew);
+                next += au_clusters - skew;
+            }
+        } else {
+            Gap *gap = NULL;
+            for (uint32_t g = 0; g < gap_count && !gap; ++g)
+                if (gaps[g].count >= node->clusters)
+                    gap = &gaps[g];
+            if (gap) {
+                node->first = gap->first;
+                gap->first += node->clusters;
+                gap->count -= node->clusters;
+                continue;
+            }
+        }
+        node->first = next;
+        next += node->clusters;
+    }
+    free(order);
+    return next <= clusters + 2 ? next : 0;
+}
+
+static void _put_time(Fat32Entry *e, time_t t) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    e->modify_time = tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2;
+    e->modify_date = (tm.tm_year < 80 ? 0 : tm.tm_year - 80) << 9
+        | (tm.tm_mon + 1) << 5 | tm.tm_mday;
+}
+
+static void _put_entry(Fat32Entry *e, const char *name, const Node *node,
+                       uint32_t cluster) {
+    memset(e, 0, sizeof (*e));
+    memcpy(e->filename, name, 11);
+    if (node->dir)
+        e->attributes.directory = 1;
+    else
+        e->attributes.archive = 1;
+    e->starting_cluster = cluster;
+    e->starting_cluster_high = cluster >> 16;
+    e->file_size = node->dir ? 0 : node->size;
+    _put_time(e, node->mtime);
+}
+
+static bool _write_at(int fd, const void *data, size_t len, uint64_t sector) {
+    return pwrite(fd, data, len, (off_t) sector * SECTOR_SIZE)
+        == (ssize_t) len;
+}
+
+/* Puts together and writes every directory. */
+static bool _write_dirs(int fd, const MkfsLayout *l) {
+    bool ok = true;
+    for (uint32_t n = 0; ok && n < node_count; ++n) {
+        Node *node = &nodes[n];
+        if (!node->dir)
+            continue;
+        size_t len = (size_t) node->clusters * cluster_bytes;
+        Fat32Entry *e = calloc(1, len);
+        Fat32Entry *out = e;
+        if (n) {
+            /* ".." of a directory in the root points at cluster 0. */
+            uint32_t up = node->parent ? nodes[node->parent].first : 0;
+            _put_entry(out++, ".          ", node, node->first);
+            _put_entry(out++, "..         ", &nodes[node->parent], up);
+        }
+        for (uint32_t c = n + 1; c < node_count; ++c)
+            if (nodes[c].parent == n)
+                _put_entry(out++, nodes[c].name, &nodes[c], nodes[c].first);
+        ok = _write_at(fd, e, len, l->data_start
+                       + (uint64_t) (node->first - 2) * l->sectors_per_cluster);
+        free(e);
+    }
+    return ok;
+}
+
+/* Streams every file into its extent. */
+static bool _write_files(int fd, const MkfsLayout *l) {
+    char *buf = malloc(COPY_CHUNK);
+    bool ok = buf != NULL;
+    for (uint32_t n = 0; ok && n < node_count; ++n) {
+        Node *node = &nodes[n];
+        if (node->dir || !node->size)
+            continue;
+        int in = open(node->path, O_RDONLY);
+        if (in < 0) {
+            perror(node->path);
+            ok = false;
+            break;
+        }
+        posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+        off_t out = ((off_t) l->data_start
+                     + (off_t) (node->first - 2) * l->sectors_per_cluster)
+            * SECTOR_SIZE;
+        uint64_t left = node->size;
+        while (ok && left) {
+            ssize_t got = read(in, buf, left < COPY_CHUNK ? left : COPY_CHUNK);
+            if (got <= 0) {
+                fprintf(stderr, "%s: changed while copying\n", node->path);
+                ok = false;
+                break;
+            }
+            ok = pwrite(fd, buf, got, out) == got;
+            out += got;
+            left -= got;
+        }
+        close(in);
+    }
+    free(buf);
+    return ok;
+}
+
+/**
+ * Both FATs in one go, then FSInfo and its backup: @param used clusters
+ * taken, the first free one at @param end or in a gap before it. */
+static bool _write_fat(int fd, const MkfsLayout *l, uint32_t used,
+                       uint32_t end) {
+    size_t len = (size_t) l->fat_sectors * SECTOR_SIZE;
+    uint32_t *fat = calloc(1, len);
+    fat[0] = 0x0ffffff8;
+    fat[1] = EOC;
+    for (uint32_t n = 0; n < node_count; ++n) {
+        Node *node = &nodes[n];
+        for (uint32_t i = 0; i < node->clusters; ++i)
+            fat[node->first + i] = i + 1 == node->clusters
+                ? EOC : node->first + i + 1;
+    }
+    bool ok = true;
+    for (uint8_t f = 0; ok && f < MKFS_NUMBER_OF_FATS; ++f)
+        ok = _write_at(fd, fat, len, l->fat_start + f * l->fat_sectors);
+    free(fat);
+
+    uint8_t sector[SECTOR_SIZE];
+    Fat32FsInfo *info = (Fat32FsInfo *) sector;
+    for (uint32_t s = 1; ok && s <= BOOT_BACKUP_SECTOR + 1;
+         s += BOOT_BACKUP_SECTOR) {
+        ok = pread(fd, sector, SECTOR_SIZE,
+                   (off_t) (l->part_start + s) * SECTOR_SIZE) == SECTOR_SIZE;
+        info->free_count = l->clusters - used;
+        info->next_free = end;
+        ok = ok && _write_at(fd, sector, SECTOR_SIZE, l->part_start + s);
+    }
+    return ok;
+}
+
+static void _usage(void) {
+    fprintf(stderr, "usage: fat32_mkimg [-s size_mib] [-c sectors_per_cluster]"
+            " [-a au_sectors] [-L label] -o image dir\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *image = NULL;
+    const char *label = "NO NAME";
+    uint64_t size_mib = 0;
+    uint8_t spc = 8;
+    uint32_t au_sectors = 8192;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:c:a:L:o:")) != -1) {
+        switch (opt) {
+        case 's': size_mib = strtoull(optarg, NULL, 0); break;
+        case 'c': spc = strtoul(optarg, NULL, 0); break;
+        case 'a': au_sectors = strtoul(optarg, NULL, 0); break;
+        case 'L': label = optarg; break;
+        case 'o': image = optarg; break;
+        default: _usage();
+        }
+    }
+    if (!image || argc - optind != 1 || !spc || (spc & (spc - 1)))
+        _usage();
+    if (au_sectors < spc)
+        au_sectors = spc;
+    cluster_bytes = spc * SECTOR_SIZE;
+    uint32_t au_clusters = au_sectors / spc;
+
+    if (!_scan(argv[optind]))
+        return 1;
+    uint64_t need = _size_nodes();
+
+    /* Without a size: what the tree needs, AU padding and some room. */
+    uint64_t clusters = need + need / 8 + 2 * au_clusters;
+    if (clusters < MKFS_MIN_CLUSTERS + 16)
+        clusters = MKFS_MIN_CLUSTERS + 16;
+    uint64_t disk = size_mib ? size_mib * 2048
+        : 2 * au_sectors + MKFS_RESERVED_SECTORS
+        + 2 * ((clusters + 2) * 4 / SECTOR_SIZE + 1) + clusters * spc;
+    if (disk > 0xffffffffULL) {
+        fprintf(stderr, "image would be larger than 2 TiB\n");
+        return 1;
+    }
+
+    MkfsLayout l;
+    if (!mkfs_layout(&l, disk, spc, au_sectors)) {
+        fprintf(stderr, "%llu sectors are too few for FAT32 with %u sector"
+                " clusters\n", (unsigned long long) disk, spc);
+        return 1;
+    }
+    uint32_t end = _place(l.clusters, au_clusters);
+    if (!end) {
+        fprintf(stderr, "%s does not fit into %llu MiB\n", argv[optind],
+                (unsigned long long) disk / 2048);
+        return 1;
+    }
+
+    int fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t) disk * SECTOR_SIZE) < 0
+        || !mkfs_write(fd, &l, label) || !_write_fat(fd, &l, need, end)
+        || !_write_dirs(fd, &l) || !_write_files(fd, &l)) {
+        perror(image);
+        return 1;
+    }
+    close(fd);
+
+    uint32_t dirs = 0;
+    for (uint32_t n = 0; n < node_count; ++n)
+        dirs += nodes[n].dir;
+    printf("%s: %u files, %u directories, %u of %u clusters used\n", image,
+           node_count - dirs, dirs, (uint32_t) need, l.clusters);
+    free(nodes);
+    free(gaps);
+    return 0;
+}
@@ -0,0 +1,235 @@
+/*
+ * Replays a sector trace recorded with FAT32_TRACE against a disk image and
+ * estimates how much card time different sector cache setups would cost.
+ *
+ * Build:  cc -O2 -I.. -o fat32_replay fat32_replay.c
+ * Usage:  fat32_replay [-w] [-c 0,1,4,16] [-s spi_hz] [-l cmd_us]
+ *                      [-b busy_us] trace.bin disk.img
+ */
+#define _DEFAULT_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fat32.h"
+
+#define SECTOR_SIZE 512
+#define MAX_CONFIGS 16
+#define TOP_TAGS 10
+
+typedef struct {
+    uint32_t sector;
+    uint32_t used;      /* LRU stamp */
+    bool valid;
+    bool dirty;
+} Slot;
+
+typedef struct {
+    uint32_t reads;
+    uint32_t writes;
+} Card;
+
+typedef struct {
+    uint16_t tag;
+    uint32_t count;
+} TagCount;
+
+static double spi_hz = 16000000;
+static double cmd_us = 100;
+static double busy_us = 500;
+
+/* Time of one block transfer: command, start token, data and CRC. */
+static double _xfer_us(void) {
+    return cmd_us + (6 + 1 + SECTOR_SIZE + 2) * 8 * 1e6 / spi_hz;
+}
+
+static double _card_us(const Card *c) {
+    return c->reads * _xfer_us() + c->writes * (_xfer_us() + busy_us);
+}
+
+static void _simulate(const Fat32TraceRecord *t, size_t n, uint32_t slots,
+                      bool write_back, Card *card) {
+    Slot *cache = calloc(slots ? slots : 1, sizeof (Slot));
+    uint32_t clock = 0;
+    memset(card, 0, sizeof (*card));
+    for (size_t i = 0; i < n; ++i) {
+        bool write = t[i].tag & FAT32_TRACE_WRITE;
+        Slot *hit = NULL;
+        Slot *victim = cache;
+        for (uint32_t s = 0; s < slots; ++s) {
+            if (cache[s].valid && cache[s].sector == t[i].sector) {
+                hit = &cache[s];
+                break;
+            }
+            if (!cache[s].valid || cache[s].used < victim->used)
+                victim = &cache[s];
+        }
+        if (!slots) {
+            if (write)
+                card->writes++;
+            else
+                card->reads++;
+            continue;
+        }
+        if (!hit) {
+            if (victim->valid && victim->dirty)
+                card->writes++;
+            hit = victim;
+            hit->sector = t[i].sector;
+            hit->valid = true;
+            hit->dirty = false;
+            /* The driver always writes whole sectors, no fill needed. */
+            if (!write)
+                card->reads++;
+        }
+        hit->used = ++clock;
+        if (write) {
+            if (write_back)
+                hit->dirty = true;
+            else
+                card->writes++;
+        }
+    }
+    for (uint32_t s = 0; s < slots; ++s)
+        if (cache[s].valid && cache[s].dirty)
+            card->writes++;
+    free(cache);
+}
+
+static int _by_count(const void *a, const void *b) {
+    const TagCount *x = a, *y = b;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+static void _usage(void) {
+    fprintf(stderr, "usage: fat32_replay [-w] [-c sizes] [-s spi_hz] "
+            "[-l cmd_us] [-b busy_us] trace.bin disk.img\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    uint32_t configs[MAX_CONFIGS] = { 0, 1, 2, 4, 8, 16, 32 };
+    int nconfigs = 7;
+    bool do_writes = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "wc:s:l:b:")) != -1) {
+        switch (opt) {
+        case 'w':
+            do_writes = true;
+            break;
+        case 'c':
+            nconfigs = 0;
+            for (char *p = strtok(optarg, ","); p && nconfigs < MAX_CONFIGS;
+                 p = strtok(NULL, ","))
+                configs[nconfigs++] = strtoul(p, NULL, 0);
+            break;
+        case 's':
+            spi_hz = atof(optarg);
+            break;
+        case 'l':
+            cmd_us = atof(optarg);
+            break;
+        case 'b':
+            busy_us = atof(optarg);
+            break;
+        default:
+            _usage();
+        }
+    }
+    if (argc - optind != 2)
+        _usage();
+
+    FILE *tf = fopen(argv[optind], "rb");
+    if (!tf) {
+        perror(argv[optind]);
+        return 1;
+    }
+    fseek(tf, 0, SEEK_END);
+    size_t n = ftell(tf) / sizeof (Fat32TraceRecord);
+    rewind(tf);
+    Fat32TraceRecord *trace = malloc(n * sizeof (Fat32TraceRecord) + 1);
+    if (fread(trace, sizeof (Fat32TraceRecord), n, tf) != n) {
+        perror(argv[optind]);
+        return 1;
+    }
+    fclose(tf);
+
+    int fd = open(argv[optind + 1], do_writes ? O_RDWR : O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+    uint32_t disk_sectors = st.st_size / SECTOR_SIZE;
+
+    /* Run the trace against the image. */
+    uint8_t buf[SECTOR_SIZE];
+    uint32_t reads = 0, writes = 0, out_of_range = 0;
+    TagCount *tags = calloc(0x10000, sizeof (TagCount));
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (size_t i = 0; i < n; ++i) {
+        bool write = trace[i].tag & FAT32_TRACE_WRITE;
+        tags[trace[i].tag].tag = trace[i].tag;
+        tags[trace[i].tag].count++;
+        if (trace[i].sector >= disk_sectors) {
+            out_of_range++;
+            continue;
+        }
+        off_t off = (off_t) trace[i].sector * SECTOR_SIZE;
+        if (pread(fd, buf, SECTOR_SIZE, off) != SECTOR_SIZE) {
+            perror("pread");
+            return 1;
+        }
+        if (write) {
+            writes++;
+            /* No payload in the trace, rewrite what is there. */
+            if (do_writes && pwrite(fd, buf, SECTOR_SIZE, off) != SECTOR_SIZE) {
+                perror("pwrite");
+                return 1;
+            }
+        } else {
+            reads++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    close(fd);
+
+    double wall_ms = (t1.tv_sec - t0.tv_sec) * 1e3
+        + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    uint32_t span = n ? trace[n - 1].time - trace[0].time : 0;
+    printf("records      %zu (%u reads, %u writes, %u out of range)\n",
+           n, reads, writes, out_of_range);
+    printf("trace span   %.3f ms\n", span / 1e3);
+    printf("replay       %.3f ms on %s\n", wall_ms, argv[optind + 1]);
+
+    printf("\n%-6s %-6s %10s %10s %8s %12s\n",
+           "cache", "policy", "reads", "writes", "saved", "card ms");
+    Card base;
+    _simulate(trace, n, 0, false, &base);
+    for (int c = 0; c < nconfigs; ++c) {
+        for (int wb = 0; wb < (configs[c] ? 2 : 1); ++wb) {
+            Card card;
+            _simulate(trace, n, configs[c], wb, &card);
+            uint32_t total = card.reads + card.writes;
+            double saved = n ? 100.0 * (n - total) / n : 0;
+            printf("%-6u %-6s %10u %10u %7.1f%% %12.3f\n", configs[c],
+                   wb ? "back" : "thru", card.reads, card.writes, saved,
+                   _card_us(&card) / 1e3);
+        }
+    }
+
+    qsort(tags, 0x10000, sizeof (TagCount), _by_count);
+    printf("\n%-16s %10s\n", "call site", "requests");
+    for (int i = 0; i < TOP_TAGS && tags[i].count; ++i)
+        printf("fat32.c:%-5u %-2s %10u\n", tags[i].tag & ~FAT32_TRACE_WRITE,
+               tags[i].tag & FAT32_TRACE_WRITE ? "W" : "R", tags[i].count);
+
+    free(tags);
+    free(trace);
+    return 0;
+}
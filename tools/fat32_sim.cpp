@@ -0,0 +1,221 @@
+/*
+ * Runs port/arduino/sdcard.cpp and fat32.c against the simulated card in
+ * port/sim and reports what each case cost in simulated card time, bus
+ * commands and blocks, so driver changes can be compared without hardware.
+ * Works on SDSIM.BIN (and a copy of it) in the root directory of an
+ * existing FAT32 image (make one with fat32_mkimg) and checks everything
+ * it reads back.
+ *
+ * Build:  c++ -O2 -fpermissive -I.. -I../port/sim -I../port/arduino \
+ *             -o fat32_sim fat32_sim.cpp -x c++ ../fat32.c -x none \
+ *             ../port/arduino/sdcard.cpp ../port/sim/sdsim.cpp
+ *         (add -DFAT32_READ_AHEAD=8 to read with CMD18 and copy with CMD25)
+ * Usage:  fat32_sim [-s spi_hz] [-l cmd_us] [-b busy_us] [-e erase_us]
+ *                   [-c crc_ppm] [-r reject_ppm] [-x seed] [-a au_code]
+ *                   [-k kib] [-S] disk.img
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "fat32.h"
+#include "sdcard.h"
+#include "sdsim.h"
+
+#define RECORD 16
+
+typedef struct {
+    SdSimStats stats;
+    uint64_t start;
+} Sample;
+
+static uint32_t kib = 256;
+static int failures = 0;
+
+static uint8_t _pattern(uint32_t pos) {
+    return (pos * 7) ^ (pos >> 9);
+}
+
+static void _fail(const char *what) {
+    fprintf(stderr, "FAIL: %s\n", what);
+    failures++;
+}
+
+static void _begin(Sample *s) {
+    s->stats = sdsim_stats;
+    s->start = sdsim_now_ns();
+}
+
+static void _end(Sample *s, const char *name, uint32_t bytes) {
+    double ms = (sdsim_now_ns() - s->start) / 1e6;
+    printf("%-8s %10.2f %8u %8u %8u %6u %6u %10.2f %10.1f\n", name, ms,
+           sdsim_stats.commands - s->stats.commands,
+           sdsim_stats.blocks_read - s->stats.blocks_read,
+           sdsim_stats.blocks_written - s->stats.blocks_written,
+           sdsim_stats.crc_errors - s->stats.crc_errors,
+           sdsim_stats.rejected - s->stats.rejected,
+           (sdsim_stats.busy_us - s->stats.busy_us) / 1e3,
+           bytes && ms > 0 ? bytes / 1024.0 / (ms / 1e3) : 0.0);
+}
+
+static void _usage(void) {
+    fprintf(stderr, "usage: fat32_sim [-s spi_hz] [-l cmd_us] [-b busy_us] "
+            "[-e erase_us] [-c crc_ppm] [-r reject_ppm] [-x seed] "
+            "[-a au_code] [-k kib] [-S] disk.img\n");
+    exit(2);
+}
+
+static void _write(Fat32File *file, uint32_t bytes) {
+    char chunk[SD_SECTOR_SIZE];
+    for (uint32_t pos = 0; pos < bytes; pos += sizeof(chunk)) {
+        for (uint32_t i = 0; i < sizeof(chunk); ++i)
+            chunk[i] = _pattern(pos + i);
+        if (fat32_write_file(file, chunk, sizeof(chunk)) != FAT32_OK)
+            return _fail("write");
+    }
+}
+
+static void _verify(Fat32File *file, uint32_t bytes) {
+    char chunk[SD_SECTOR_SIZE];
+    uint32_t pos = 0;
+    uint16_t got;
+    file->cursor = 0;
+    while ((got = fat32_read_file(file, chunk, sizeof(chunk))) > 0) {
+        for (uint16_t i = 0; i < got; ++i)
+            if ((uint8_t) chunk[i] != _pattern(pos + i))
+                return _fail("read back");
+        pos += got;
+    }
+    if (pos != bytes)
+        _fail("read size");
+}
+
+int main(int argc, char **argv) {
+    SdSimConfig config = {};
+    Fat32File file;
+    Sample s;
+    int opt;
+
+    config.seed = 1;
+    while ((opt = getopt(argc, argv, "s:l:b:e:c:r:x:a:k:S")) != -1) {
+        switch (opt) {
+        case 's': config.spi_hz = strtoul(optarg, NULL, 0); break;
+        case 'l': config.cmd_us = strtoul(optarg, NULL, 0); break;
+        case 'b': config.busy_us = strtoul(optarg, NULL, 0); break;
+        case 'e': config.erase_us = strtoul(optarg, NULL, 0); break;
+        case 'c': config.crc_ppm = strtoul(optarg, NULL, 0); break;
+        case 'r': config.reject_ppm = strtoul(optarg, NULL, 0); break;
+        case 'x': config.seed = strtoul(optarg, NULL, 0); break;
+        case 'a': config.au_size = strtoul(optarg, NULL, 0); break;
+        case 'k': kib = strtoul(optarg, NULL, 0); break;
+        case 'S': config.sdsc = true; break;
+        default: _usage();
+        }
+    }
+    if (optind + 1 != argc)
+        _usage();
+    if (!sdsim_open(argv[optind], &config)) {
+        perror(argv[optind]);
+        return 2;
+    }
+
+    printf("%-8s %10s %8s %8s %8s %6s %6s %10s %10s\n", "case", "ms",
+           "cmds", "rblocks", "wblocks", "crc", "rej", "busy ms", "KiB/s");
+    _begin(&s);
+    if (!sdcard_init_peripheral()) {
+        fprintf(stderr, "card did not come up\n");
+        return 2;
+    }
+    _end(&s, "init", 0);
+    uint8_t csd[16];
+    if (!sdcard_request_csd(csd))
+        _fail("CSD");
+    printf("card: %u KiB, %s, AU %u sectors\n", sdcard_calculate_size(csd),
+           sdcard_is_hcxc ? "SDHC" : "SDSC", sdcard_request_au_size());
+
+    _begin(&s);
+    if (fat32_mount() != FAT32_OK) {
+        fprintf(stderr, "not a FAT32 image\n");
+        return 2;
+    }
+    _end(&s, "mount", 0);
+
+    uint32_t bytes = kib * 1024;
+    if (fat32_find_file(&file, "SDSIM.BIN") == FAT32_OK)
+        fat32_delete_file(&file);
+    _begin(&s);
+    if (fat32_create_file(&file, "SDSIM.BIN") != FAT32_OK) {
+        fprintf(stderr, "cannot create SDSIM.BIN\n");
+        return 2;
+    }
+    _write(&file, bytes);
+    _end(&s, "write", bytes);
+
+    _begin(&s);
+    if (fat32_find_file(&file, "SDSIM.BIN") != FAT32_OK)
+        _fail("find");
+    else
+        _verify(&file, bytes);
+    _end(&s, "read", bytes);
+
+    /* Play it back a record at a time with a refill step in between and
+     * see how long the longest step took on the bus. */
+    uint8_t stream_buf[2 * SD_SECTOR_SIZE];
+    Fat32Stream stream;
+    char chunk[RECORD];
+    file.cursor = 0;
+    _begin(&s);
+    if (fat32_stream_open(&stream, &file, stream_buf) != FAT32_OK)
+        _fail("stream");
+    for (uint32_t pos = 0; pos < bytes; pos += RECORD) {
+        bool same = fat32_stream_read(&stream, chunk, RECORD) == RECORD;
+        for (uint32_t i = 0; same && i < RECORD; ++i)
+            same = (uint8_t) chunk[i] == _pattern(pos + i);
+        if (!same) {
+            _fail("stream read back");
+            break;
+        }
+        fat32_stream_refill(&stream);
+    }
+    _end(&s, "stream", bytes);
+    printf("stream: %u us worst refill, %u misses\n", stream.worst_us,
+           stream.misses);
+
+    Fat32File copy;
+    _begin(&s);
+    if (fat32_copy_file(&file, "SDSIM2.BIN", &copy) != FAT32_OK)
+        _fail("copy");
+    _end(&s, "copy", bytes);
+    _verify(&copy, bytes);
+    fat32_delete_file(&copy);
+
+    uint8_t buffer[SD_SECTOR_SIZE];
+    char record[RECORD];
+    _begin(&s);
+    fat32_append_mode(&file, buffer);
+    for (uint32_t pos = bytes; pos < 2 * bytes; pos += RECORD) {
+        for (uint32_t i = 0; i < RECORD; ++i)
+            record[i] = _pattern(pos + i);
+        fat32_write_file(&file, record, RECORD);
+    }
+    if (fat32_flush(&file) != FAT32_OK)
+        _fail("flush");
+    _end(&s, "append", bytes);
+
+    if (fat32_find_file(&file, "SDSIM.BIN") != FAT32_OK)
+        _fail("find");
+    else
+        _verify(&file, 2 * bytes);
+
+    _begin(&s);
+    if (fat32_delete_file(&file) != FAT32_OK)
+        _fail("delete");
+    _end(&s, "delete", 0);
+
+    printf("total: %.2f ms simulated, %u commands, %u illegal, "
+           "%llu bytes on the bus\n", sdsim_now_ns() / 1e6,
+           sdsim_stats.commands, sdsim_stats.illegal,
+           (unsigned long long) sdsim_stats.bytes);
+    sdsim_close();
+    return failures ? 1 : 0;
+}
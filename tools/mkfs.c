@@ -0,0 +1,139 @@
+/*
+ * Minimal FAT32 formatter shared by the host tools.
+ */
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mkfs.h"
+
+#define SECTOR_SIZE 512
+#define BOOT_BACKUP_SECTOR 6
+#define FAT_ENTRIES_PER_SECTOR (SECTOR_SIZE / 4)
+
+bool mkfs_layout(MkfsLayout *layout, uint32_t disk_sectors,
+                 uint8_t sectors_per_cluster, uint32_t align) {
+    if (!align)
+        align = 1;
+    memset(layout, 0, sizeof (*layout));
+    layout->part_start = align;
+    if (disk_sectors <= layout->part_start)
+        return false;
+    layout->part_sectors = disk_sectors - layout->part_start;
+    layout->sectors_per_cluster = sectors_per_cluster;
+
+    /* Grow the FAT until it covers every cluster left behind it. */
+    uint32_t fat_sectors = 1;
+    for (;;) {
+        uint32_t meta = MKFS_RESERVED_SECTORS
+            + MKFS_NUMBER_OF_FATS * fat_sectors;
+        /* Pad the reserved area so the data area lands on a boundary. */
+        uint32_t pad = (align - (layout->part_start + meta) % align) % align;
+        if (meta + pad >= layout->part_sectors)
+            return false;
+        uint32_t clusters = (layout->part_sectors - meta - pad)
+            / sectors_per_cluster;
+        uint32_t need = (clusters + 2 + FAT_ENTRIES_PER_SECTOR - 1)
+            / FAT_ENTRIES_PER_SECTOR;
+        if (need <= fat_sectors) {
+            layout->reserved_sectors = MKFS_RESERVED_SECTORS + pad;
+            layout->fat_sectors = fat_sectors;
+            layout->clusters = clusters;
+            break;
+        }
+        fat_sectors = need;
+    }
+    layout->fat_start = layout->part_start + layout->reserved_sectors;
+    layout->data_start = layout->fat_start
+        + MKFS_NUMBER_OF_FATS * layout->fat_sectors;
+    return layout->clusters >= MKFS_MIN_CLUSTERS;
+}
+
+static bool _put(int fd, uint32_t sector, const void *data, uint32_t count) {
+    ssize_t len = (ssize_t) count * SECTOR_SIZE;
+    return pwrite(fd, data, len, (off_t) sector * SECTOR_SIZE) == len;
+}
+
+bool mkfs_write(int fd, const MkfsLayout *layout, const char *label) {
+    uint8_t sector[SECTOR_SIZE];
+
+    /* MBR with one partition. */
+    memset(sector, 0, sizeof (sector));
+    PartitionTable *pt = (PartitionTable *) (sector + PARTITION_TABLE_OFFSET);
+    memset(pt->start_chs, 0xff, sizeof (pt->start_chs));
+    memset(pt->end_chs, 0xff, sizeof (pt->end_chs));
+    pt->partition_type = FAT32_PT_TYPE;
+    pt->start_sector = layout->part_start;
+    pt->length_sectors = layout->part_sectors;
+    *(uint16_t *) (sector + SECTOR_SIZE - 2) = BOOT_SIGNATURE;
+    if (!_put(fd, 0, sector, 1))
+        return false;
+
+    /* Boot sector and its backup. */
+    memset(sector, 0, sizeof (sector));
+    Fat32BootSector *bs = (Fat32BootSector *) sector;
+    memcpy(bs->_jmp, "\xeb\x58\x90", 3);
+    memcpy(bs->oem, "MSWIN4.1", 8);
+    bs->sector_size = SECTOR_SIZE;
+    bs->sectors_per_cluster = layout->sectors_per_cluster;
+    bs->reserved_sectors = layout->reserved_sectors;
+    bs->number_of_fats = MKFS_NUMBER_OF_FATS;
+    bs->media_descriptor = 0xf8;
+    bs->sectors_per_track = 63;
+    bs->number_of_heads = 255;
+    bs->hidden_sectors = layout->part_start;
+    bs->total_sectors_u32 = layout->part_sectors;
+    bs->fat_size_sectors = layout->fat_sectors;
+    bs->cluster_num_for_root = 2;
+    bs->sector_fsinfo = 1;
+    bs->sector_boot_bkup = BOOT_BACKUP_SECTOR;
+    bs->drive_number = 0x80;
+    bs->boot_signature = 0x29;
+    bs->volume_id = (uint32_t) time(NULL);
+    memset(bs->volume_label, ' ', sizeof (bs->volume_label));
+    if (label)
+        memcpy(bs->volume_label, label, strnlen(label, 11));
+    memcpy(bs->fs_type, "FAT32   ", 8);
+    bs->boot_sector_signature = BOOT_SIGNATURE;
+    if (!_put(fd, layout->part_start, sector, 1)
+        || !_put(fd, layout->part_start + BOOT_BACKUP_SECTOR, sector, 1))
+        return false;
+
+    /* FSInfo and its backup, the root directory takes one cluster. */
+    memset(sector, 0, sizeof (sector));
+    Fat32FsInfo *info = (Fat32FsInfo *) sector;
+    info->lead_signature = FSINFO_LEAD_SIGNATURE;
+    info->struct_signature = FSINFO_STRUCT_SIGNATURE;
+    info->free_count = layout->clusters - 1;
+    info->next_free = 3;
+    info->trail_signature = FSINFO_TRAIL_SIGNATURE;
+    if (!_put(fd, layout->part_start + 1, sector, 1)
+        || !_put(fd, layout->part_start + BOOT_BACKUP_SECTOR + 1, sector, 1))
+        return false;
+
+    /* Both FATs, written in large chunks. */
+    const uint32_t chunk = 256;
+    uint8_t *zero = calloc(chunk, SECTOR_SIZE);
+    bool ok = zero != NULL;
+    for (uint8_t f = 0; ok && f < MKFS_NUMBER_OF_FATS; ++f) {
+        uint32_t start = layout->fat_start + f * layout->fat_sectors;
+        for (uint32_t s = 0; ok && s < layout->fat_sectors; s += chunk) {
+            uint32_t n = layout->fat_sectors - s;
+            ok = _put(fd, start + s, zero, n < chunk ? n : chunk);
+        }
+        uint32_t *fat = (uint32_t *) sector;
+        memset(sector, 0, sizeof (sector));
+        fat[0] = 0x0ffffff8;
+        fat[1] = 0x0fffffff;
+        fat[2] = 0x0fffffff;      /* root directory */
+        ok = ok && _put(fd, start, sector, 1);
+    }
+
+    /* Empty root directory. */
+    for (uint8_t s = 0; ok && s < layout->sectors_per_cluster; ++s)
+        ok = _put(fd, layout->data_start + s, zero, 1);
+    free(zero);
+    return ok;
+}
@@ -0,0 +1,38 @@
+#ifndef MKFS_LIB
+#define MKFS_LIB
+
+#include <stdint.h>
+
+#include "fat32.h"
+
+#define MKFS_RESERVED_SECTORS 32
+#define MKFS_NUMBER_OF_FATS 2
+#define MKFS_MIN_CLUSTERS 65525   /* Anything less is not FAT32. */
+
+/* Where everything goes on a freshly formatted disk, absolute sectors. */
+typedef struct {
+    uint32_t part_start;
+    uint32_t part_sectors;
+    uint8_t sectors_per_cluster;
+    uint16_t reserved_sectors;
+    uint32_t fat_sectors;         /* Per FAT. */
+    uint32_t clusters;            /* Data clusters, numbered from 2. */
+    uint32_t fat_start;
+    uint32_t data_start;
+} MkfsLayout;
+
+/**
+ * Lays out a single FAT32 partition on a disk of @param disk_sectors.
+ * The partition and the data area both start on multiples of
+ * @param align sectors.
+ * @return false if the disk is too small for FAT32 at this cluster size. */
+bool mkfs_layout(MkfsLayout *layout, uint32_t disk_sectors,
+                 uint8_t sectors_per_cluster, uint32_t align);
+
+/**
+ * Writes MBR, boot sector, FSInfo, their backups, both FATs and an empty
+ * root directory at cluster 2 to @param fd.
+ * @return false on I/O errors. */
+bool mkfs_write(int fd, const MkfsLayout *layout, const char *label);
+
+#endif /* MKFS_LIB */